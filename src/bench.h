@@ -0,0 +1,61 @@
+/*
+ * Lightweight Autonomic Network Architecture
+ *
+ * Common parts of the benchmark test modules. They run on load, print
+ * their results and leave nothing behind.
+ *
+ * Subject to the GPL.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/types.h>
+#include <linux/math64.h>
+#include <asm/timex.h>
+
+#define BENCH_SEED	2463534242U
+
+/* xorshift32 for picking random targets, cheaper than what is measured */
+static inline u32 bench_next(u32 x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+/* Module that runs bench() once on load */
+#define BENCH_MODULE(name, bench, desc)					\
+	static int __init init_##name##_module(void)			\
+	{								\
+		return bench();						\
+	}								\
+	static void __exit cleanup_##name##_module(void)		\
+	{								\
+	}								\
+	module_init(init_##name##_module);				\
+	module_exit(cleanup_##name##_module);				\
+	MODULE_LICENSE("GPL");						\
+	MODULE_DESCRIPTION(desc)
+
+/* Module that runs bench(size) on load for each of the given sizes */
+#define BENCH_MODULE_SIZES(name, bench, sizes, desc)			\
+	static int __init bench_##name##_sizes(void)			\
+	{								\
+		int ret;						\
+		unsigned int i;						\
+									\
+		for (i = 0; i < ARRAY_SIZE(sizes); ++i) {		\
+			ret = bench(sizes[i]);				\
+			if (ret)					\
+				return ret;				\
+		}							\
+		return 0;						\
+	}								\
+	BENCH_MODULE(name, bench_##name##_sizes, desc)
+
+#endif /* BENCH_H */
@@ -0,0 +1,125 @@
+/*
+ * Lightweight Autonomic Network Architecture
+ *
+ * Benchmark test module for the per hop cost of the engine. Builds a
+ * chain of 16 dummy fblocks, pushes skbs through it on load and prints
+ * cycles per packet and per hop. Needs fb_dummy to be loaded.
+ *
+ * Subject to the GPL.
+ */
+
+#include <linux/skbuff.h>
+#include <linux/rcupdate.h>
+#include <linux/interrupt.h>
+
+#include "bench.h"
+#include "xt_fblock.h"
+#include "xt_builder.h"
+#include "xt_idp.h"
+#include "xt_skb.h"
+#include "xt_engine.h"
+
+#define BENCH_HOPS	16
+#define BENCH_BATCH	64
+#define BENCH_ROUNDS	4096
+
+static struct fblock *bench_fbs[BENCH_HOPS];
+
+static void bench_chain_destroy(unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i + 1 < num; ++i)
+		fblock_unbind(bench_fbs[i], bench_fbs[i + 1]);
+	for (i = 0; i < num; ++i)
+		unregister_fblock_namespace(bench_fbs[i]);
+}
+
+static int bench_chain_build(void)
+{
+	int ret;
+	unsigned int i;
+	char name[FBNAMSIZ];
+
+	for (i = 0; i < BENCH_HOPS; ++i) {
+		snprintf(name, sizeof(name), "bench%u", i);
+		bench_fbs[i] = build_fblock_object("dummy", name);
+		if (!bench_fbs[i]) {
+			bench_chain_destroy(i);
+			return -ENOENT;
+		}
+	}
+	/* Egress path goes from bench0 down to bench15 */
+	for (i = 0; i + 1 < BENCH_HOPS; ++i) {
+		ret = fblock_bind(bench_fbs[i], bench_fbs[i + 1]);
+		if (ret) {
+			while (i-- > 0)
+				fblock_unbind(bench_fbs[i], bench_fbs[i + 1]);
+			for (i = 0; i < BENCH_HOPS; ++i)
+				unregister_fblock_namespace(bench_fbs[i]);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int bench_chain_run(u64 *cycles, u64 *pkts)
+{
+	unsigned int i, r;
+	cycles_t start;
+	struct sk_buff *skbs[BENCH_BATCH];
+
+	*cycles = *pkts = 0;
+	for (r = 0; r < BENCH_ROUNDS; ++r) {
+		for (i = 0; i < BENCH_BATCH; ++i) {
+			skbs[i] = alloc_skb(64, GFP_KERNEL);
+			if (!skbs[i]) {
+				while (i-- > 0)
+					kfree_skb(skbs[i]);
+				return -ENOMEM;
+			}
+			skb_put(skbs[i], 64);
+			write_next_idp_to_skb(skbs[i], IDP_UNKNOWN,
+					      bench_fbs[0]->idp);
+		}
+
+		/* The last hop has no egress port and drops them */
+		local_bh_disable();
+		rcu_read_lock();
+		start = get_cycles();
+		process_packet_array(skbs, BENCH_BATCH, TYPE_EGRESS);
+		*cycles += get_cycles() - start;
+		rcu_read_unlock();
+		local_bh_enable();
+
+		*pkts += BENCH_BATCH;
+	}
+
+	return 0;
+}
+
+static int bench_chain(void)
+{
+	int ret;
+	u64 cycles, pkts;
+
+	ret = bench_chain_build();
+	if (ret) {
+		printk(KERN_ERR "[lana] bench chain: cannot build chain, "
+		       "fb_dummy loaded?\n");
+		return ret;
+	}
+
+	ret = bench_chain_run(&cycles, &pkts);
+	if (!ret)
+		printk(KERN_INFO "[lana] bench chain: %u hops, %llu pkts, "
+		       "%llu cycles/pkt, %llu cycles/hop\n", BENCH_HOPS, pkts,
+		       div64_u64(cycles, pkts),
+		       div64_u64(cycles, pkts * BENCH_HOPS));
+
+	bench_chain_destroy(BENCH_HOPS);
+	return ret;
+}
+
+BENCH_MODULE(bench_chain, bench_chain, "LANA fblock chain benchmark");
@@ -0,0 +1,129 @@
+/*
+ * Lightweight Autonomic Network Architecture
+ *
+ * Benchmark test module for the carrier lookup of fb_eth's rx handler.
+ * Compares a walk over the list of hooked carriers against resolving the
+ * carrier through the device's rx_handler_data at 1, 8 and 64 carriers
+ * with frames arriving on random carriers and prints cycles per frame on
+ * load.
+ *
+ * Subject to the GPL.
+ */
+
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/netdevice.h>
+#include <linux/rcupdate.h>
+
+#include "bench.h"
+#include "xt_idp.h"
+
+#define BENCH_FRAMES	(1 << 20)
+
+static const unsigned int bench_sizes[] = { 1, 8, 64 };
+
+/* Stands in for fb_eth's struct fb_eth_dev_node */
+struct bench_node {
+	idp_t idp;
+	idp_t port;
+	struct net_device *dev;
+	struct list_head list;
+};
+
+static u64 bench_list(struct list_head *head, struct net_device **devs,
+		      unsigned int num)
+{
+	unsigned int i;
+	unsigned long sum = 0;
+	u32 x = BENCH_SEED;
+	cycles_t start;
+	struct bench_node *node, *this;
+	struct net_device *dev;
+
+	rcu_read_lock();
+	start = get_cycles();
+	for (i = 0; i < BENCH_FRAMES; ++i) {
+		x = bench_next(x);
+		dev = devs[x % num];
+		this = NULL;
+		list_for_each_entry_rcu(node, head, list)
+			if (dev == node->dev)
+				this = node;
+		sum += this->port;
+	}
+	start = get_cycles() - start;
+	rcu_read_unlock();
+
+	WARN_ON(sum != BENCH_FRAMES);
+	return start;
+}
+
+static u64 bench_data(struct net_device **devs, unsigned int num)
+{
+	unsigned int i;
+	unsigned long sum = 0;
+	u32 x = BENCH_SEED;
+	cycles_t start;
+	struct bench_node *node;
+
+	rcu_read_lock();
+	start = get_cycles();
+	for (i = 0; i < BENCH_FRAMES; ++i) {
+		x = bench_next(x);
+		node = rcu_dereference(devs[x % num]->rx_handler_data);
+		sum += ACCESS_ONCE(node->port);
+	}
+	start = get_cycles() - start;
+	rcu_read_unlock();
+
+	WARN_ON(sum != BENCH_FRAMES);
+	return start;
+}
+
+static int bench_run(unsigned int num)
+{
+	int ret = -ENOMEM;
+	unsigned int i;
+	u64 t_list, t_data;
+	struct bench_node *nodes;
+	struct net_device **devs;
+	LIST_HEAD(head);
+
+	nodes = kcalloc(num, sizeof(*nodes), GFP_KERNEL);
+	if (!nodes)
+		return ret;
+	devs = kcalloc(num, sizeof(*devs), GFP_KERNEL);
+	if (!devs)
+		goto out;
+
+	/* Dummy devices, only their rx_handler_data is used */
+	for (i = 0; i < num; ++i) {
+		devs[i] = kzalloc(sizeof(*devs[i]), GFP_KERNEL);
+		if (!devs[i])
+			goto out_devs;
+		nodes[i].idp = i + 1;
+		nodes[i].port = 1;
+		nodes[i].dev = devs[i];
+		RCU_INIT_POINTER(devs[i]->rx_handler_data, &nodes[i]);
+		list_add_rcu(&nodes[i].list, &head);
+	}
+
+	t_list = bench_list(&head, devs, num);
+	t_data = bench_data(devs, num);
+
+	printk(KERN_INFO "[lana] bench ethrx: %2u carriers, list %llu, "
+	       "rx_handler_data %llu cycles/frame\n", num,
+	       div_u64(t_list, BENCH_FRAMES),
+	       div_u64(t_data, BENCH_FRAMES));
+	ret = 0;
+out_devs:
+	for (i = 0; i < num; ++i)
+		kfree(devs[i]);
+	kfree(devs);
+out:
+	kfree(nodes);
+	return ret;
+}
+
+BENCH_MODULE_SIZES(bench_ethrx, bench_run, bench_sizes,
+		   "LANA fb_eth carrier lookup benchmark");
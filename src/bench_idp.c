@@ -0,0 +1,109 @@
+/*
+ * Lightweight Autonomic Network Architecture
+ *
+ * Benchmark test module for the idp to fblock translation. Compares the
+ * flat fblock table against a radix tree at 10, 1k and 100k blocks with
+ * random lookups and prints cycles per lookup on load.
+ *
+ * Subject to the GPL.
+ */
+
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+
+#include "bench.h"
+#include "xt_fblock.h"
+#include "xt_idp.h"
+
+#define BENCH_LOOKUPS	(1 << 20)
+
+static const unsigned int bench_sizes[] = { 10, 1000, 100000 };
+
+static u64 bench_radix(struct radix_tree_root *root, unsigned int num)
+{
+	unsigned int i;
+	unsigned long hits = 0;
+	u32 x = BENCH_SEED;
+	cycles_t start;
+
+	rcu_read_lock();
+	start = get_cycles();
+	for (i = 0; i < BENCH_LOOKUPS; ++i) {
+		x = bench_next(x);
+		if (radix_tree_lookup(root, 1 + x % num))
+			hits++;
+	}
+	start = get_cycles() - start;
+	rcu_read_unlock();
+
+	WARN_ON(hits != BENCH_LOOKUPS);
+	return start;
+}
+
+static u64 bench_flat(struct fblock_table *tab, unsigned int num)
+{
+	unsigned int i;
+	unsigned long hits = 0;
+	u32 x = BENCH_SEED;
+	cycles_t start;
+
+	rcu_read_lock();
+	start = get_cycles();
+	for (i = 0; i < BENCH_LOOKUPS; ++i) {
+		x = bench_next(x);
+		if (__fblock_table_lookup(tab, 1 + x % num))
+			hits++;
+	}
+	start = get_cycles() - start;
+	rcu_read_unlock();
+
+	WARN_ON(hits != BENCH_LOOKUPS);
+	return start;
+}
+
+static int bench_run(unsigned int num)
+{
+	int ret = -ENOMEM;
+	unsigned int i, size = roundup_pow_of_two(num + 1);
+	u64 t_radix, t_flat;
+	struct fblock *fbs;
+	struct fblock_table *tab;
+	RADIX_TREE(root, GFP_KERNEL);
+
+	/* Dummies are only needed for their address */
+	fbs = vzalloc(num * sizeof(*fbs));
+	if (!fbs)
+		return ret;
+	tab = vzalloc(sizeof(*tab) + size * sizeof(tab->slot[0]));
+	if (!tab)
+		goto out;
+	tab->size = size;
+
+	for (i = 0; i < num; ++i) {
+		ret = radix_tree_insert(&root, i + 1, &fbs[i]);
+		if (ret)
+			goto out_radix;
+		RCU_INIT_POINTER(tab->slot[i + 1], &fbs[i]);
+	}
+
+	t_radix = bench_radix(&root, num);
+	t_flat = bench_flat(tab, num);
+
+	printk(KERN_INFO "[lana] bench idp: %6u blocks, radix %llu, flat "
+	       "%llu cycles/lookup\n", num,
+	       div_u64(t_radix, BENCH_LOOKUPS),
+	       div_u64(t_flat, BENCH_LOOKUPS));
+	ret = 0;
+out_radix:
+	for (i = 0; i < num; ++i)
+		radix_tree_delete(&root, i + 1);
+	vfree(tab);
+out:
+	vfree(fbs);
+	return ret;
+}
+
+BENCH_MODULE_SIZES(bench_idp, bench_run, bench_sizes,
+		   "LANA idp lookup benchmark");
@@ -18,6 +18,7 @@
 #include "xt_builder.h"
 #include "xt_user.h"
 #include "xt_engine.h"
+#include "xt_latency.h"
 
 struct proc_dir_entry *lana_proc_dir;
 EXPORT_SYMBOL(lana_proc_dir);
@@ -51,9 +52,14 @@ static int __init init_lana_core_module(void)
 	ret = init_engine();
 	if (ret)
 		goto err5;
+	ret = init_latency();
+	if (ret)
+		goto err6;
 
 	printk(KERN_INFO "[lana] core up and running!\n");
 	return 0;
+err6:
+	cleanup_engine();
 err5:
 	cleanup_userctl_system();
 err4:
@@ -78,6 +84,7 @@ static void __exit cleanup_lana_core_module(void)
 	cleanup_fblock_builder();
 	cleanup_vlink_system();
 	cleanup_engine();
+	cleanup_latency();
 	remove_proc_entry("fblock", lana_proc_dir);
 	remove_proc_entry("lana", init_net.proc_net);
 
@@ -49,9 +49,9 @@
 #include "xt_engine.h"
 #include "xt_builder.h"
 
+/* Shared by all CPUs, the filter is replaced as a whole under RCU */
 struct fb_bpf_priv {
-	idp_t port[2];
-	struct sk_filter *filter;
+	struct sk_filter __rcu *filter;
 	spinlock_t flock;
 };
 
@@ -77,42 +77,47 @@ static inline void fb_bpf_jit_free(struct sk_filter *fp)
 {
 }
 
-static int fb_bpf_init_filter(struct fb_bpf_priv __percpu *fb_priv_cpu,
-			      struct sock_fprog_kern *fprog, unsigned int cpu)
+/* Replaces the filter by fprog, or removes it if fprog is NULL */
+static int fb_bpf_init_filter(struct fb_bpf_priv *fb_priv,
+			      struct sock_fprog_kern *fprog)
 {
 	int err;
-	struct sk_filter *sf, *sfold;
+	struct sk_filter *sf = NULL, *sfold;
 	unsigned int fsize;
 	unsigned long flags;
 
-	if (fprog->filter == NULL)
-		return -EINVAL;
+	if (fprog) {
+		if (fprog->filter == NULL)
+			return -EINVAL;
 
-	fsize = sizeof(struct sock_filter) * fprog->len;
+		fsize = sizeof(struct sock_filter) * fprog->len;
 
-	sf = kmalloc_node(fsize + sizeof(*sf), GFP_KERNEL, cpu_to_node(cpu));
-	if (!sf)
-		return -ENOMEM;
+		sf = kmalloc(fsize + sizeof(*sf), GFP_KERNEL);
+		if (!sf)
+			return -ENOMEM;
 
-	memcpy(sf->insns, fprog->filter, fsize);
-	atomic_set(&sf->refcnt, 1);
-	sf->len = fprog->len;
-	sf->bpf_func = sk_run_filter;
+		memcpy(sf->insns, fprog->filter, fsize);
+		atomic_set(&sf->refcnt, 1);
+		sf->len = fprog->len;
+		sf->bpf_func = sk_run_filter;
 
-	err = sk_chk_filter(sf->insns, sf->len);
-	if (err) {
-		kfree(sf);
-		return err;
-	}
+		err = sk_chk_filter(sf->insns, sf->len);
+		if (err) {
+			kfree(sf);
+			return err;
+		}
 
-	fb_bpf_jit_compile(sf);
+		fb_bpf_jit_compile(sf);
+	}
 
-	spin_lock_irqsave(&fb_priv_cpu->flock, flags);
-	sfold = fb_priv_cpu->filter;
-	fb_priv_cpu->filter = sf;
-	spin_unlock_irqrestore(&fb_priv_cpu->flock, flags);
+	spin_lock_irqsave(&fb_priv->flock, flags);
+	sfold = rcu_dereference_protected(fb_priv->filter,
+					  lockdep_is_held(&fb_priv->flock));
+	rcu_assign_pointer(fb_priv->filter, sf);
+	spin_unlock_irqrestore(&fb_priv->flock, flags);
 
 	if (sfold) {
+		synchronize_rcu();
 		fb_bpf_jit_free(sfold);
 		kfree(sfold);
 	}
@@ -120,165 +125,117 @@ static int fb_bpf_init_filter(struct fb_bpf_priv __percpu *fb_priv_cpu,
 	return 0;
 }
 
-static int fb_bpf_init_filter_cpus(struct fblock *fb,
-				   struct sock_fprog_kern *fprog)
+static int fb_bpf_set_filter(struct fblock *fb, struct sock_fprog_kern *fprog)
 {
-	int err = 0;
-	unsigned int cpu;
-	struct fb_bpf_priv __percpu *fb_priv;
+	int err;
+	struct fb_bpf_priv *fb_priv;
 
-	if (!fprog || !fb)
+	if (!fb)
 		return -EINVAL;
 
 	rcu_read_lock();
-	fb_priv = (struct fb_bpf_priv __percpu *) rcu_dereference_raw(fb->private_data);
+	fb_priv = (struct fb_bpf_priv *) rcu_dereference_raw(fb->private_data);
 	rcu_read_unlock();
 
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		struct fb_bpf_priv *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-		err = fb_bpf_init_filter(fb_priv_cpu, fprog, cpu);
-		if (err != 0) {
-			printk(KERN_ERR "[%s::%s] fb_bpf_init_filter error: %d\n",
-			       fb->name, fb->factory->type, err);
-			break;
-		}
-	}
-	put_online_cpus();
+	err = fb_bpf_init_filter(fb_priv, fprog);
+	if (err)
+		printk(KERN_ERR "[%s::%s] fb_bpf_init_filter error: %d\n",
+		       fb->name, fb->factory->type, err);
 
 	return err;
 }
 
-static void fb_bpf_cleanup_filter(struct fb_bpf_priv __percpu *fb_priv_cpu)
-{
-	unsigned long flags;
-	struct sk_filter *sfold;
-
-	spin_lock_irqsave(&fb_priv_cpu->flock, flags);
-	sfold = fb_priv_cpu->filter;
-	fb_priv_cpu->filter = NULL;
-	spin_unlock_irqrestore(&fb_priv_cpu->flock, flags);
-
-	if (sfold) {
-		fb_bpf_jit_free(sfold);
-		kfree(sfold);
-	}
-}
-
-static void fb_bpf_cleanup_filter_cpus(struct fblock *fb)
-{
-	unsigned int cpu;
-	struct fb_bpf_priv __percpu *fb_priv;
-
-	if (!fb)
-		return;
-
-	rcu_read_lock();
-	fb_priv = (struct fb_bpf_priv __percpu *) rcu_dereference_raw(fb->private_data);
-	rcu_read_unlock();
-
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		struct fb_bpf_priv *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-		fb_bpf_cleanup_filter(fb_priv_cpu);
-	}
-	put_online_cpus();
-}
-
 static int fb_bpf_netrx(const struct fblock * const fb,
 			struct sk_buff * const skb,
 			enum path_type * const dir)
 {
-	int drop = 0;
+	idp_t port = fblock_port(fb, *dir);
 	unsigned int pkt_len;
-	unsigned long flags;
-	struct fb_bpf_priv __percpu *fb_priv_cpu;
+	struct sk_filter *sf;
+	struct fb_bpf_priv *fb_priv;
 
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference_raw(fb->private_data));
+	fb_priv = (struct fb_bpf_priv *) rcu_dereference_raw(fb->private_data);
 
-	spin_lock_irqsave(&fb_priv_cpu->flock, flags);
-	if (fb_priv_cpu->filter) {
-		pkt_len = SK_RUN_FILTER(fb_priv_cpu->filter, skb);
+	sf = rcu_dereference(fb_priv->filter);
+	if (sf) {
+		pkt_len = SK_RUN_FILTER(sf, skb);
 		if (pkt_len < skb->len) {
-			spin_unlock_irqrestore(&fb_priv_cpu->flock, flags);
 			kfree_skb(skb);
 			return PPE_DROPPED;
 		}
 	}
-	write_next_idp_to_skb(skb, fb->idp, fb_priv_cpu->port[*dir]);
-	if (fb_priv_cpu->port[*dir] == IDP_UNKNOWN)
-		drop = 1;
-	spin_unlock_irqrestore(&fb_priv_cpu->flock, flags);
-	if (drop) {
+	write_next_idp_to_skb(skb, fb->idp, port);
+	if (port == IDP_UNKNOWN) {
 		kfree_skb(skb);
 		return PPE_DROPPED;
 	}
 	return PPE_SUCCESS;
 }
 
+static void fb_bpf_netrx_bulk(const struct fblock * const fb,
+			      struct sk_buff ** const skbs,
+			      int * const rets, unsigned int num,
+			      enum path_type * const dir)
+{
+	unsigned int i, pkt_len;
+	idp_t port = fblock_port(fb, *dir);
+	struct sk_filter *sf;
+	struct fb_bpf_priv *fb_priv;
+
+	fb_priv = (struct fb_bpf_priv *) rcu_dereference_raw(fb->private_data);
+
+	sf = rcu_dereference(fb_priv->filter);
+	for (i = 0; i < num; ++i) {
+		if (sf) {
+			pkt_len = SK_RUN_FILTER(sf, skbs[i]);
+			if (pkt_len < skbs[i]->len) {
+				rets[i] = PPE_DROPPED;
+				continue;
+			}
+		}
+		if (port == IDP_UNKNOWN) {
+			rets[i] = PPE_DROPPED;
+			continue;
+		}
+		write_next_idp_to_skb(skbs[i], fb->idp, port);
+		rets[i] = PPE_SUCCESS;
+	}
+
+	for (i = 0; i < num; ++i)
+		if (rets[i] == PPE_DROPPED)
+			kfree_skb(skbs[i]);
+}
+
 static int fb_bpf_event(struct notifier_block *self, unsigned long cmd,
 			void *args)
 {
 	int ret = NOTIFY_OK;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_bpf_priv __percpu *fb_priv;
 
 	rcu_read_lock();
 	fb = rcu_dereference_raw(container_of(self, struct fblock_notifier, nb)->self);
-	fb_priv = (struct fb_bpf_priv __percpu *) rcu_dereference_raw(fb->private_data);
 	rcu_read_unlock();
 
 	switch (cmd) {
 	case FBLOCK_BIND_IDP: {
-		int bound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_bpf_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			spin_lock(&fb_priv_cpu->flock);
-			if (fb_priv_cpu->port[msg->dir] == IDP_UNKNOWN) {
-				fb_priv_cpu->port[msg->dir] = msg->idp;
-				bound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				spin_unlock(&fb_priv_cpu->flock);
-				break;
-			}
-			spin_unlock(&fb_priv_cpu->flock);
+		if (fblock_bind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (bound)
-			printk(KERN_INFO "[%s::%s] port %s bound to IDP%u\n",
-			       fb->name, fb->factory->type,
-			       path_names[msg->dir], msg->idp);
+		printk(KERN_INFO "[%s::%s] port %s bound to IDP%u\n",
+		       fb->name, fb->factory->type,
+		       path_names[msg->dir], msg->idp);
 		} break;
 	case FBLOCK_UNBIND_IDP: {
-		int unbound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_bpf_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			spin_lock(&fb_priv_cpu->flock);
-			if (fb_priv_cpu->port[msg->dir] == msg->idp) {
-				fb_priv_cpu->port[msg->dir] = IDP_UNKNOWN;
-				unbound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				spin_unlock(&fb_priv_cpu->flock);
-				break;
-			}
-			spin_unlock(&fb_priv_cpu->flock);
+		if (fblock_unbind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (unbound)
-			printk(KERN_INFO "[%s::%s] port %s unbound\n",
-			       fb->name, fb->factory->type,
-			       path_names[msg->dir]);
+		printk(KERN_INFO "[%s::%s] port %s unbound\n",
+		       fb->name, fb->factory->type,
+		       path_names[msg->dir]);
 		} break;
 	default:
 		break;
@@ -289,18 +246,13 @@ static int fb_bpf_event(struct notifier_block *self, unsigned long cmd,
 
 static int fb_bpf_proc_show_filter(struct seq_file *m, void *v)
 {
-	unsigned long flags;
 	struct fblock *fb = (struct fblock *) m->private;
-	struct fb_bpf_priv *fb_priv_cpu;
+	struct fb_bpf_priv *fb_priv;
 	struct sk_filter *sf;
 
-	get_online_cpus();
 	rcu_read_lock();
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference_raw(fb->private_data));
-	rcu_read_unlock();
-
-	spin_lock_irqsave(&fb_priv_cpu->flock, flags);
-	sf = fb_priv_cpu->filter;
+	fb_priv = (struct fb_bpf_priv *) rcu_dereference_raw(fb->private_data);
+	sf = rcu_dereference(fb_priv->filter);
 	if (sf) {
 		unsigned int i;
 		if (sf->bpf_func == sk_run_filter)
@@ -321,8 +273,7 @@ static int fb_bpf_proc_show_filter(struct seq_file *m, void *v)
 			seq_puts(m, sline);
 		}
 	}
-	spin_unlock_irqrestore(&fb_priv_cpu->flock, flags);
-	put_online_cpus();
+	rcu_read_unlock();
 
 	return 0;
 }
@@ -402,15 +353,14 @@ static ssize_t fb_bpf_proc_write(struct file *file, const char __user * ubuff,
 		       fp->filter[i].k);
 	}
 
-	fb_bpf_cleanup_filter_cpus(fb);
-	ret = fb_bpf_init_filter_cpus(fb, fp);
+	ret = fb_bpf_set_filter(fb, fp);
 	if (!ret)
 		printk(KERN_INFO "[%s::%s] Filter injected!\n",
 		       fb->name, fb->factory->type);
 	else {
 		printk(KERN_ERR "[%s::%s] Filter injection error: %ld!\n",
 		       fb->name, fb->factory->type, ret);
-		fb_bpf_cleanup_filter_cpus(fb);
+		fb_bpf_set_filter(fb, NULL);
 	}
 
 	kfree(code);
@@ -440,35 +390,25 @@ static const struct file_operations fb_bpf_proc_fops = {
 static struct fblock *fb_bpf_ctor(char *name)
 {
 	int ret = 0;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_bpf_priv __percpu *fb_priv;
+	struct fb_bpf_priv *fb_priv;
 	struct proc_dir_entry *fb_proc;
 
 	fb = alloc_fblock(GFP_ATOMIC);
 	if (!fb)
 		return NULL;
 
-	fb_priv = alloc_percpu(struct fb_bpf_priv);
+	fb_priv = kzalloc(sizeof(*fb_priv), GFP_ATOMIC);
 	if (!fb_priv)
 		goto err;
-
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		struct fb_bpf_priv *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-		spin_lock_init(&fb_priv_cpu->flock);
-		fb_priv_cpu->port[0] = IDP_UNKNOWN;
-		fb_priv_cpu->port[1] = IDP_UNKNOWN;
-		fb_priv_cpu->filter = NULL;
-	}
-	put_online_cpus();
+	spin_lock_init(&fb_priv->flock);
 
 	ret = init_fblock(fb, name, fb_priv);
 	if (ret)
 		goto err2;
 
 	fb->netfb_rx = fb_bpf_netrx;
+	fb->netfb_rx_bulk = fb_bpf_netrx_bulk;
 	fb->event_rx = fb_bpf_event;
 
 	fb_proc = proc_create_data(fb->name, 0444, fblock_proc_dir,
@@ -488,7 +428,7 @@ err4:
 err3:
 	cleanup_fblock_ctor(fb);
 err2:
-	free_percpu(fb_priv);
+	kfree(fb_priv);
 err:
 	kfree_fblock(fb);
 	return NULL;
@@ -496,22 +436,26 @@ err:
 
 static void fb_bpf_dtor(struct fblock *fb)
 {
-	free_percpu(rcu_dereference_raw(fb->private_data));
+	struct sk_filter *sf;
+	struct fb_bpf_priv *fb_priv;
+
+	/* Called after a grace period, no readers left */
+	fb_priv = (struct fb_bpf_priv *) rcu_dereference_raw(fb->private_data);
+	sf = rcu_dereference_raw(fb_priv->filter);
+	if (sf) {
+		fb_bpf_jit_free(sf);
+		kfree(sf);
+	}
+	kfree(fb_priv);
 	remove_proc_entry(fb->name, fblock_proc_dir);
 	module_put(THIS_MODULE);
 }
 
-static void fb_bpf_dtor_outside_rcu(struct fblock *fb)
-{
-	fb_bpf_cleanup_filter_cpus(fb);
-}
-
 static struct fblock_factory fb_bpf_factory = {
 	.type = "bpf",
 	.mode = MODE_DUAL,
 	.ctor = fb_bpf_ctor,
 	.dtor = fb_bpf_dtor,
-	.dtor_outside_rcu = fb_bpf_dtor_outside_rcu,
 	.owner = THIS_MODULE,
 };
 
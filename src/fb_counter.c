@@ -13,7 +13,6 @@
 #include <linux/spinlock.h>
 #include <linux/notifier.h>
 #include <linux/rcupdate.h>
-#include <linux/seqlock.h>
 #include <linux/percpu.h>
 #include <linux/prefetch.h>
 #include <linux/u64_stats_sync.h>
@@ -28,8 +27,6 @@
 #include "xt_builder.h"
 
 struct fb_counter_priv {
-	idp_t port[2];
-	seqlock_t lock;
 	u64 packets;
 	u64 bytes;
 	struct u64_stats_sync syncp;
@@ -39,90 +36,90 @@ static int fb_counter_netrx(const struct fblock * const fb,
 			    struct sk_buff * const skb,
 			    enum path_type * const dir)
 {
-	int drop = 0;
-	unsigned int seq;
-	struct fb_counter_priv __percpu *fb_priv_cpu;
+	idp_t port = fblock_port(fb, *dir);
+	struct fb_counter_priv *fb_priv_cpu;
 
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference_raw(fb->private_data));
+	fb_priv_cpu = fblock_lazy_this_cpu(rcu_dereference_raw(fb->private_data),
+					   sizeof(*fb_priv_cpu));
 	prefetchw(skb->cb);
-	do {
-		seq = read_seqbegin(&fb_priv_cpu->lock);
-		write_next_idp_to_skb(skb, fb->idp, fb_priv_cpu->port[*dir]);
-		if (fb_priv_cpu->port[*dir] == IDP_UNKNOWN)
-			drop = 1;
-	} while (read_seqretry(&fb_priv_cpu->lock, seq));
+	write_next_idp_to_skb(skb, fb->idp, port);
 
-	u64_stats_update_begin(&fb_priv_cpu->syncp);
-	fb_priv_cpu->packets++;
-	fb_priv_cpu->bytes += skb->len;
-	u64_stats_update_end(&fb_priv_cpu->syncp);
+	if (likely(fb_priv_cpu)) {
+		u64_stats_update_begin(&fb_priv_cpu->syncp);
+		fb_priv_cpu->packets++;
+		fb_priv_cpu->bytes += skb->len;
+		u64_stats_update_end(&fb_priv_cpu->syncp);
+	}
 
-	if (drop) {
+	if (port == IDP_UNKNOWN) {
 		kfree_skb(skb);
 		return PPE_DROPPED;
 	}
 	return PPE_SUCCESS;
 }
 
+static void fb_counter_netrx_bulk(const struct fblock * const fb,
+				  struct sk_buff ** const skbs,
+				  int * const rets, unsigned int num,
+				  enum path_type * const dir)
+{
+	u64 bytes = 0;
+	unsigned int i;
+	idp_t port = fblock_port(fb, *dir);
+	struct fb_counter_priv *fb_priv_cpu;
+
+	fb_priv_cpu = fblock_lazy_this_cpu(rcu_dereference_raw(fb->private_data),
+					   sizeof(*fb_priv_cpu));
+
+	for (i = 0; i < num; ++i) {
+		bytes += skbs[i]->len;
+		if (port == IDP_UNKNOWN) {
+			kfree_skb(skbs[i]);
+			rets[i] = PPE_DROPPED;
+			continue;
+		}
+		write_next_idp_to_skb(skbs[i], fb->idp, port);
+		rets[i] = PPE_SUCCESS;
+	}
+
+	if (unlikely(!fb_priv_cpu))
+		return;
+	u64_stats_update_begin(&fb_priv_cpu->syncp);
+	fb_priv_cpu->packets += num;
+	fb_priv_cpu->bytes += bytes;
+	u64_stats_update_end(&fb_priv_cpu->syncp);
+}
+
 static int fb_counter_event(struct notifier_block *self, unsigned long cmd,
 			    void *args)
 {
 	int ret = NOTIFY_OK;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_counter_priv __percpu *fb_priv;
 
 	rcu_read_lock();
 	fb = rcu_dereference_raw(container_of(self, struct fblock_notifier, nb)->self);
-	fb_priv = (struct fb_counter_priv __percpu *) rcu_dereference_raw(fb->private_data);
 	rcu_read_unlock();
 
 	switch (cmd) {
 	case FBLOCK_BIND_IDP: {
-		int bound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_counter_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == IDP_UNKNOWN) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = msg->idp;
-				write_sequnlock(&fb_priv_cpu->lock);
-				bound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fblock_bind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (bound)
-			printk(KERN_INFO "[%s::%s] port %s bound to IDP%u\n",
-			       fb->name, fb->factory->type,
-			       path_names[msg->dir], msg->idp);
+		printk(KERN_INFO "[%s::%s] port %s bound to IDP%u\n",
+		       fb->name, fb->factory->type,
+		       path_names[msg->dir], msg->idp);
 		} break;
 	case FBLOCK_UNBIND_IDP: {
-		int unbound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_counter_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == msg->idp) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = IDP_UNKNOWN;
-				write_sequnlock(&fb_priv_cpu->lock);
-				unbound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fblock_unbind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (unbound)
-			printk(KERN_INFO "[%s::%s] port %s unbound\n",
-			       fb->name, fb->factory->type,
-			       path_names[msg->dir]);
+		printk(KERN_INFO "[%s::%s] port %s unbound\n",
+		       fb->name, fb->factory->type,
+		       path_names[msg->dir]);
 		} break;
 	case FBLOCK_SET_OPT: {
 		struct fblock_opt_msg *msg = args;
@@ -141,24 +138,25 @@ static int fb_counter_proc_show(struct seq_file *m, void *v)
 	unsigned int cpu;
 	char sline[256];
 	struct fblock *fb = (struct fblock *) m->private;
-	struct fb_counter_priv __percpu *fb_priv;
+	struct fblock_lazy *fb_priv;
 
 	rcu_read_lock();
-	fb_priv = (struct fb_counter_priv __percpu *) rcu_dereference_raw(fb->private_data);
+	fb_priv = (struct fblock_lazy *) rcu_dereference_raw(fb->private_data);
 	rcu_read_unlock();
 
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
+	/* CPUs gone offline still hold their share */
+	for_each_possible_cpu(cpu) {
 		unsigned int start;
 		struct fb_counter_priv *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
+		fb_priv_cpu = fblock_lazy_cpu(fb_priv, cpu);
+		if (!fb_priv_cpu)
+			continue;
 		do {
 			start = u64_stats_fetch_begin(&fb_priv_cpu->syncp);
 			pkts_sum += fb_priv_cpu->packets;
 			bytes_sum += fb_priv_cpu->bytes;
 		} while (u64_stats_fetch_retry(&fb_priv_cpu->syncp, start));
 	}
-	put_online_cpus();
 
 	memset(sline, 0, sizeof(sline));
 	snprintf(sline, sizeof(sline), "%llu %llu\n", pkts_sum, bytes_sum);
@@ -183,35 +181,24 @@ static const struct file_operations fb_counter_proc_fops = {
 static struct fblock *fb_counter_ctor(char *name)
 {
 	int ret = 0;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_counter_priv __percpu *fb_priv;
+	struct fblock_lazy *fb_priv;
 	struct proc_dir_entry *fb_proc;
 
 	fb = alloc_fblock(GFP_ATOMIC);
 	if (!fb)
 		return NULL;
 
-	fb_priv = alloc_percpu(struct fb_counter_priv);
+	/* Counters get created per CPU on its first packet */
+	fb_priv = fblock_lazy_alloc();
 	if (!fb_priv)
 		goto err;
 
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		struct fb_counter_priv *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-		seqlock_init(&fb_priv_cpu->lock);
-		fb_priv_cpu->port[0] = IDP_UNKNOWN;
-		fb_priv_cpu->port[1] = IDP_UNKNOWN;
-		fb_priv_cpu->packets = 0;
-		fb_priv_cpu->bytes = 0;
-	}
-	put_online_cpus();
-
 	ret = init_fblock(fb, name, fb_priv);
 	if (ret)
 		goto err2;
 	fb->netfb_rx = fb_counter_netrx;
+	fb->netfb_rx_bulk = fb_counter_netrx_bulk;
 	fb->event_rx = fb_counter_event;
 
 	fb_proc = proc_create_data(fb->name, 0444, fblock_proc_dir,
@@ -231,7 +218,7 @@ err4:
 err3:
 	cleanup_fblock_ctor(fb);
 err2:
-	free_percpu(fb_priv);
+	fblock_lazy_free(fb_priv);
 err:
 	kfree_fblock(fb);
 	return NULL;
@@ -239,7 +226,7 @@ err:
 
 static void fb_counter_dtor(struct fblock *fb)
 {
-	free_percpu(rcu_dereference_raw(fb->private_data));
+	fblock_lazy_free((struct fblock_lazy *) rcu_dereference_raw(fb->private_data));
 	remove_proc_entry(fb->name, fblock_proc_dir);
 	module_put(THIS_MODULE);
 }
@@ -13,7 +13,6 @@
 #include <linux/spinlock.h>
 #include <linux/notifier.h>
 #include <linux/rcupdate.h>
-#include <linux/seqlock.h>
 #include <linux/percpu.h>
 #include <linux/prefetch.h>
 
@@ -24,48 +23,51 @@
 #include "xt_engine.h"
 #include "xt_builder.h"
 
-struct fb_dummy_priv {
-	idp_t port[2];
-	seqlock_t lock;
-};
-
 static int fb_dummy_netrx(const struct fblock * const fb,
 			  struct sk_buff * const skb,
 			  enum path_type * const dir)
 {
-	int drop = 0;
-	unsigned int seq;
-	struct fb_dummy_priv __percpu *fb_priv_cpu;
+	idp_t port = fblock_port(fb, *dir);
 
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference_raw(fb->private_data));
 #ifdef __DEBUG
 	printk("Got skb on %p on ppe%d!\n", fb, smp_processor_id());
 #endif
 	prefetchw(skb->cb);
-	do {
-		seq = read_seqbegin(&fb_priv_cpu->lock);
-		write_next_idp_to_skb(skb, fb->idp, fb_priv_cpu->port[*dir]);
-		if (fb_priv_cpu->port[*dir] == IDP_UNKNOWN)
-			drop = 1;
-	} while (read_seqretry(&fb_priv_cpu->lock, seq));
-	if (drop) {
+	write_next_idp_to_skb(skb, fb->idp, port);
+	if (port == IDP_UNKNOWN) {
 		kfree_skb(skb);
 		return PPE_DROPPED;
 	}
 	return PPE_SUCCESS;
 }
 
+static void fb_dummy_netrx_bulk(const struct fblock * const fb,
+				struct sk_buff ** const skbs,
+				int * const rets, unsigned int num,
+				enum path_type * const dir)
+{
+	unsigned int i;
+	idp_t port = fblock_port(fb, *dir);
+
+	for (i = 0; i < num; ++i) {
+		if (port == IDP_UNKNOWN) {
+			kfree_skb(skbs[i]);
+			rets[i] = PPE_DROPPED;
+			continue;
+		}
+		write_next_idp_to_skb(skbs[i], fb->idp, port);
+		rets[i] = PPE_SUCCESS;
+	}
+}
+
 static int fb_dummy_event(struct notifier_block *self, unsigned long cmd,
 			  void *args)
 {
 	int ret = NOTIFY_OK;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_dummy_priv __percpu *fb_priv;
 
 	rcu_read_lock();
 	fb = rcu_dereference_raw(container_of(self, struct fblock_notifier, nb)->self);
-	fb_priv = (struct fb_dummy_priv __percpu *) rcu_dereference_raw(fb->private_data);
 	rcu_read_unlock();
 
 #ifdef __DEBUG
@@ -74,50 +76,24 @@ static int fb_dummy_event(struct notifier_block *self, unsigned long cmd,
 
 	switch (cmd) {
 	case FBLOCK_BIND_IDP: {
-		int bound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_dummy_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == IDP_UNKNOWN) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = msg->idp;
-				write_sequnlock(&fb_priv_cpu->lock);
-				bound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fblock_bind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (bound)
-			printk(KERN_INFO "[%s::%s] port %s bound to IDP%u\n",
-			       fb->name, fb->factory->type,
-			       path_names[msg->dir], msg->idp);
+		printk(KERN_INFO "[%s::%s] port %s bound to IDP%u\n",
+		       fb->name, fb->factory->type,
+		       path_names[msg->dir], msg->idp);
 		} break;
 	case FBLOCK_UNBIND_IDP: {
-		int unbound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_dummy_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == msg->idp) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = IDP_UNKNOWN;
-				write_sequnlock(&fb_priv_cpu->lock);
-				unbound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fblock_unbind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (unbound)
-			printk(KERN_INFO "[%s::%s] port %s unbound\n",
-			       fb->name, fb->factory->type,
-			       path_names[msg->dir]);
+		printk(KERN_INFO "[%s::%s] port %s unbound\n",
+		       fb->name, fb->factory->type,
+		       path_names[msg->dir]);
 		} break;
 	case FBLOCK_SET_OPT: {
 		struct fblock_opt_msg *msg = args;
@@ -133,32 +109,18 @@ static int fb_dummy_event(struct notifier_block *self, unsigned long cmd,
 static struct fblock *fb_dummy_ctor(char *name)
 {
 	int ret = 0;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_dummy_priv __percpu *fb_priv;
 
 	fb = alloc_fblock(GFP_ATOMIC);
 	if (!fb)
 		return NULL;
 
-	fb_priv = alloc_percpu(struct fb_dummy_priv);
-	if (!fb_priv)
-		goto err;
-
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		struct fb_dummy_priv *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-		seqlock_init(&fb_priv_cpu->lock);
-		fb_priv_cpu->port[0] = IDP_UNKNOWN;
-		fb_priv_cpu->port[1] = IDP_UNKNOWN;
-	}
-	put_online_cpus();
-
-	ret = init_fblock(fb, name, fb_priv);
+	/* All state lives in the fblock's ports */
+	ret = init_fblock(fb, name, NULL);
 	if (ret)
-		goto err2;
+		goto err;
 	fb->netfb_rx = fb_dummy_netrx;
+	fb->netfb_rx_bulk = fb_dummy_netrx_bulk;
 	fb->event_rx = fb_dummy_event;
 	ret = register_fblock_namespace(fb);
 	if (ret)
@@ -167,8 +129,6 @@ static struct fblock *fb_dummy_ctor(char *name)
 	return fb;
 err3:
 	cleanup_fblock_ctor(fb);
-err2:
-	free_percpu(fb_priv);
 err:
 	kfree_fblock(fb);
 	return NULL;
@@ -176,7 +136,6 @@ err:
 
 static void fb_dummy_dtor(struct fblock *fb)
 {
-	free_percpu(rcu_dereference_raw(fb->private_data));
 	module_put(THIS_MODULE);
 }
 
@@ -18,7 +18,7 @@
 #include <linux/if.h>
 #include <linux/etherdevice.h>
 #include <linux/rtnetlink.h>
-#include <linux/seqlock.h>
+#include <linux/slab.h>
 
 #include "xt_idp.h"
 #include "xt_engine.h"
@@ -26,24 +26,35 @@
 #include "xt_fblock.h"
 #include "xt_builder.h"
 #include "xt_vlink.h"
+#include "xt_latency.h"
 
 #define IFF_VLINK_MAS	0x20000
 #define IFF_VLINK_DEV	0x40000
 #define IFF_IS_BRIDGED  0x60000
 
-struct fb_eth_priv {
-	idp_t port[2];
-	seqlock_t lock;
-	struct net_device *dev;
-};
-
 static LIST_HEAD(fb_eth_devs);
 static DEFINE_SPINLOCK(fb_eth_devs_lock);
 
+/*
+ * Hooked carrier, it is the rx_handler_data of dev, so that the rx handler
+ * finds everything it needs with one dereference. idp is set before the
+ * handler gets registered, port mirrors the ingress port of fb and is kept
+ * up to date by fb_eth_event().
+ */
 struct fb_eth_dev_node {
-	struct list_head list;
+	idp_t idp;
+	idp_t port;
+	int xmit;
+	struct engine_steer steer;
 	struct fblock *fb;
 	struct net_device *dev;
+	struct list_head list;
+};
+
+/* Read-only after creation, hence shared by all CPUs */
+struct fb_eth_priv {
+	struct net_device *dev;
+	struct fb_eth_dev_node *node;
 };
 
 static inline int fb_eth_dev_is_bridged(struct net_device *dev)
@@ -68,11 +79,9 @@ static inline void fb_eth_make_dev_unbridged(struct net_device *dev)
 
 static rx_handler_result_t fb_eth_handle_frame(struct sk_buff **pskb)
 {
-	unsigned int seq;
+	idp_t port;
 	struct sk_buff *skb = *pskb;
 	struct fb_eth_dev_node *node;
-	struct fblock *fb = NULL;
-	struct fb_eth_priv __percpu *fb_priv_cpu;
 
 	if (unlikely(skb->pkt_type == PACKET_LOOPBACK))
 		return RX_HANDLER_PASS;
@@ -82,25 +91,17 @@ static rx_handler_result_t fb_eth_handle_frame(struct sk_buff **pskb)
 	if (unlikely(!skb))
 		return RX_HANDLER_CONSUMED;
 
-	list_for_each_entry_rcu(node, &fb_eth_devs, list)
-		if (skb->dev == node->dev)
-			fb = node->fb;
-	if (!fb)
+	node = rcu_dereference(skb->dev->rx_handler_data);
+	port = ACCESS_ONCE(node->port);
+	if (port == IDP_UNKNOWN)
 		goto drop;
 
 	skb_orphan(skb);
 
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference(fb->private_data));
-	if (fb_priv_cpu->port[TYPE_INGRESS] == IDP_UNKNOWN)
-		goto drop;
-
-	do {
-		seq = read_seqbegin(&fb_priv_cpu->lock);
-		write_next_idp_to_skb(skb, fb->idp,
-				      fb_priv_cpu->port[TYPE_INGRESS]);
-	} while (read_seqretry(&fb_priv_cpu->lock, seq));
+	write_next_idp_to_skb(skb, node->idp, port);
 
-	process_packet(skb, TYPE_INGRESS);
+	latency_mark_ingress(skb, node->idp);
+	engine_steer_packet(&node->steer, skb, TYPE_INGRESS);
 
 	return RX_HANDLER_CONSUMED;
 drop:
@@ -112,71 +113,77 @@ static int fb_eth_netrx(const struct fblock * const fb,
 			struct sk_buff * const skb,
 			enum path_type * const dir)
 {
-	struct fb_eth_priv __percpu *fb_priv_cpu;
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference(fb->private_data));
+	struct fb_eth_priv *fb_priv;
+	fb_priv = (struct fb_eth_priv *) rcu_dereference(fb->private_data);
 	write_next_idp_to_skb(skb, fb->idp, IDP_UNKNOWN);
-	skb->dev = fb_priv_cpu->dev;
-	dev_queue_xmit(skb);
+	latency_mark_egress(skb);
+	skb->dev = fb_priv->dev;
+	engine_xmit(skb, ACCESS_ONCE(fb_priv->node->xmit));
 	return PPE_DROPPED;
 }
 
+/* The caller holds a reference on fb, so the node stays around */
+static inline struct fb_eth_dev_node *fb_eth_node(struct fblock *fb)
+{
+	return ((struct fb_eth_priv *)
+		rcu_dereference_raw(fb->private_data))->node;
+}
+
+static void fb_eth_update_port(struct fblock *fb)
+{
+	rcu_read_lock();
+	ACCESS_ONCE(fb_eth_node(fb)->port) = fblock_port(fb, TYPE_INGRESS);
+	rcu_read_unlock();
+}
+
+static int fb_eth_set_option(struct fblock *fb, struct fblock_opt_msg *msg)
+{
+	struct fb_eth_dev_node *node = fb_eth_node(fb);
+	int ret = engine_xmit_set_option(&node->xmit, msg->key, msg->val);
+
+	if (ret == -ENOENT)
+		ret = engine_steer_set_option(&node->steer, msg->key, msg->val);
+	return ret;
+}
+
 static int fb_eth_event(struct notifier_block *self, unsigned long cmd,
 			void *args)
 {
 	int ret = NOTIFY_OK;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_eth_priv __percpu *fb_priv;
 
 	rcu_read_lock();
 	fb = rcu_dereference_raw(container_of(self, struct fblock_notifier, nb)->self);
-	fb_priv = (struct fb_eth_priv __percpu *) rcu_dereference_raw(fb->private_data);
 	rcu_read_unlock();
 
 	switch (cmd) {
 	case FBLOCK_BIND_IDP: {
-		int bound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_eth_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == IDP_UNKNOWN) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = msg->idp;
-				write_sequnlock(&fb_priv_cpu->lock);
-				bound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fblock_bind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (bound)
-			printk(KERN_INFO "[%s::vlink] port %s bound to IDP%u\n",
-			       fb->name, path_names[msg->dir], msg->idp);
+		fb_eth_update_port(fb);
+		printk(KERN_INFO "[%s::vlink] port %s bound to IDP%u\n",
+		       fb->name, path_names[msg->dir], msg->idp);
 		} break;
 	case FBLOCK_UNBIND_IDP: {
-		int unbound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_eth_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == msg->idp) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = IDP_UNKNOWN;
-				write_sequnlock(&fb_priv_cpu->lock);
-				unbound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fblock_unbind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (unbound)
-			printk(KERN_INFO "[%s::vlink] port %s unbound\n",
-			       fb->name, path_names[msg->dir]);
+		fb_eth_update_port(fb);
+		printk(KERN_INFO "[%s::vlink] port %s unbound\n",
+		       fb->name, path_names[msg->dir]);
+		} break;
+	case FBLOCK_SET_OPT: {
+		struct fblock_opt_msg *msg = args;
+		if (fb_eth_set_option(fb, msg))
+			ret = NOTIFY_BAD;
+		else
+			printk(KERN_INFO "[%s::vlink] option %s set to %s\n",
+			       fb->name, msg->key, msg->val);
 		} break;
 	default:
 		break;
@@ -195,11 +202,13 @@ static void cleanup_fb_eth(struct net_device *dev)
 	rtnl_unlock();
 }
 
-static int init_fb_eth(struct net_device *dev)
+static int init_fb_eth(struct fb_eth_dev_node *node)
 {
 	int ret = 0;
+	struct net_device *dev = node->dev;
+
 	rtnl_lock();
-	ret = netdev_rx_handler_register(dev, fb_eth_handle_frame, NULL);
+	ret = netdev_rx_handler_register(dev, fb_eth_handle_frame, node);
 	if (ret)
 		ret = -EIO;
 	else
@@ -208,31 +217,22 @@ static int init_fb_eth(struct net_device *dev)
 	return ret;
 }
 
-static struct fblock *fb_eth_build_fblock(struct net_device *dev)
+static struct fblock *fb_eth_build_fblock(struct fb_eth_dev_node *node)
 {
 	int ret = 0;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_eth_priv __percpu *fb_priv;
+	struct fb_eth_priv *fb_priv;
+	struct net_device *dev = node->dev;
 
 	fb = alloc_fblock(GFP_ATOMIC);
 	if (!fb)
 		return NULL;
 
-	fb_priv = alloc_percpu(struct fb_eth_priv);
+	fb_priv = kzalloc(sizeof(*fb_priv), GFP_ATOMIC);
 	if (!fb_priv)
 		goto err;
-
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		struct fb_eth_priv *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-		seqlock_init(&fb_priv_cpu->lock);
-		fb_priv_cpu->port[0] = IDP_UNKNOWN;
-		fb_priv_cpu->port[1] = IDP_UNKNOWN;
-		fb_priv_cpu->dev = dev;
-	}
-	put_online_cpus();
+	fb_priv->dev = dev;
+	fb_priv->node = node;
 
 	ret = init_fblock(fb, dev->name, fb_priv);
 	if (ret)
@@ -245,7 +245,10 @@ static struct fblock *fb_eth_build_fblock(struct net_device *dev)
 	ret = register_fblock_namespace(fb);
 	if (ret)
 		goto err3;
-	ret = init_fb_eth(dev);
+	node->fb = fb;
+	node->idp = fb->idp;
+	node->port = IDP_UNKNOWN;
+	ret = init_fb_eth(node);
 	if (ret)
 		goto err4;
 	__module_get(THIS_MODULE);
@@ -256,7 +259,7 @@ err4:
 err3:
 	cleanup_fblock_ctor(fb);
 err2:
-	free_percpu(fb_priv);
+	kfree(fb_priv);
 err:
 	kfree_fblock(fb);
 	fb = NULL;
@@ -265,16 +268,18 @@ err:
 
 static void fb_eth_destroy_fblock(struct fblock *fb)
 {
-	struct fb_eth_priv __percpu *fb_priv_cpu;
+	struct fb_eth_priv *fb_priv;
 
 	rcu_read_lock();
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference(fb->private_data));
-	cleanup_fb_eth(fb_priv_cpu->dev);
+	fb_priv = (struct fb_eth_priv *) rcu_dereference(fb->private_data);
+	cleanup_fb_eth(fb_priv->dev);
 	rcu_read_unlock();
 
 	unregister_fblock_namespace_no_rcu(fb);
+	/* Engines may still use fb without holding a reference */
+	synchronize_rcu();
 	cleanup_fblock(fb);
-	free_percpu(rcu_dereference_raw(fb->private_data));
+	kfree(rcu_dereference_raw(fb->private_data));
 	kfree_fblock(fb);
 	module_put(THIS_MODULE);
 }
@@ -310,7 +315,9 @@ static int fb_eth_start_hook_dev(struct vlinknlmsg *vhdr, struct nlmsghdr *nlh)
 	if (!node)
 		goto out;
 	node->dev = dev;
-	node->fb = fb_eth_build_fblock(dev);
+	node->xmit = XMIT_QUEUE;
+	engine_steer_init(&node->steer);
+	node->fb = fb_eth_build_fblock(node);
 	if (!node->fb) {
 		kfree(node);
 		goto out;
@@ -371,6 +378,7 @@ static int fb_eth_stop_hook_dev(struct vlinknlmsg *vhdr, struct nlmsghdr *nlh)
 
 	fb_eth_destroy_fblock(fb);
 	synchronize_rcu();
+	engine_steer_destroy(&node->steer);
 	kfree(node);
 
 	printk(KERN_INFO "[lana] hook detached from carrier %s\n",
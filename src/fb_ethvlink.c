@@ -25,7 +25,7 @@
 #include <linux/if.h>
 #include <linux/list.h>
 #include <linux/u64_stats_sync.h>
-#include <linux/seqlock.h>
+#include <linux/slab.h>
 #include <net/rtnetlink.h>
 
 #include "xt_idp.h"
@@ -33,6 +33,7 @@
 #include "xt_skb.h"
 #include "xt_vlink.h"
 #include "xt_fblock.h"
+#include "xt_latency.h"
 
 #define IFF_VLINK_MAS	0x20000 /* Master device */
 #define IFF_VLINK_DEV	0x40000 /* Slave device */
@@ -40,6 +41,15 @@
 
 /* Ethernet LANA packet with 10 Bit tag ID */
 #define ETH_P_LANA    0xAC00
+#define FB_ETHVLINK_TAGS	1024
+
+/* Offloads we take over from the real device */
+#define FB_ETHVLINK_FEATURES	(NETIF_F_SG | NETIF_F_ALL_CSUM |	\
+				 NETIF_F_HIGHDMA | NETIF_F_FRAGLIST |	\
+				 NETIF_F_GSO | NETIF_F_TSO |		\
+				 NETIF_F_TSO_ECN | NETIF_F_TSO6 |	\
+				 NETIF_F_UFO | NETIF_F_GSO_ROBUST |	\
+				 NETIF_F_GRO | NETIF_F_RXCSUM)
 
 struct pcpu_dstats {
 	u64 rx_packets;
@@ -58,13 +68,25 @@ static struct ethtool_ops fb_ethvlink_ethtool_ops __read_mostly;
 static struct header_ops fb_ethvlink_header_ops __read_mostly;
 
 static LIST_HEAD(fb_ethvlink_vdevs);
+static LIST_HEAD(fb_ethvlink_carriers);
 static DEFINE_SPINLOCK(fb_ethvlink_vdevs_lock);
 
 struct fb_ethvlink_private;
 
+/*
+ * Tag to vdev table of a real device, handed to the rx handler as its
+ * rx_handler_data, so that demultiplexing is a single load. It exists
+ * while the real device is hooked or has vdevs stacked on it.
+ */
+struct fb_ethvlink_carrier {
+	struct list_head list;
+	struct net_device *real_dev;
+	unsigned int num;
+	struct rcu_head rcu;
+	struct fb_ethvlink_private __rcu *vdev[FB_ETHVLINK_TAGS];
+};
+
 struct fb_ethvlink_private_inner {
-	idp_t port[2];
-	seqlock_t lock;
 	struct fb_ethvlink_private *vdev;
 };
 
@@ -75,6 +97,9 @@ struct fb_ethvlink_private {
 	struct net_device *real_dev;
 	int (*netvif_rx)(struct sk_buff *skb, struct fb_ethvlink_private *vdev);
 	struct fblock *fb;
+	struct engine_steer steer;
+	int xmit;
+	struct list_head batch;
 };
 
 static int fb_ethvlink_init(struct net_device *dev)
@@ -94,7 +119,7 @@ static int fb_ethvlink_open(struct net_device *dev)
 {
 	struct fb_ethvlink_private *dev_priv = netdev_priv(dev);
 
-	netif_start_queue(dev);
+	netif_tx_start_all_queues(dev);
 	if (netif_carrier_ok(dev_priv->real_dev)) {
 		netif_tx_lock_bh(dev);
 		netif_carrier_on(dev);
@@ -109,7 +134,7 @@ static int fb_ethvlink_stop(struct net_device *dev)
 	netif_tx_lock_bh(dev);
 	netif_carrier_off(dev);
 	netif_tx_unlock_bh(dev);
-	netif_stop_queue(dev);
+	netif_tx_stop_all_queues(dev);
 
 	return 0;
 }
@@ -134,65 +159,106 @@ static inline void fb_ethvlink_make_real_dev_unhooked(struct net_device *dev)
 	dev->priv_flags &= ~IFF_VLINK_MAS;
 }
 
+static struct fb_ethvlink_carrier *
+fb_ethvlink_carrier_find(struct net_device *real_dev)
+{
+	struct fb_ethvlink_carrier *carrier;
+
+	list_for_each_entry(carrier, &fb_ethvlink_carriers, list)
+		if (carrier->real_dev == real_dev)
+			return carrier;
+	return NULL;
+}
+
+/* Returns the carrier of real_dev, creates it if need be. */
+static struct fb_ethvlink_carrier *
+fb_ethvlink_carrier_get(struct net_device *real_dev)
+{
+	unsigned long flags;
+	struct fb_ethvlink_carrier *carrier, *new;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+
+	spin_lock_irqsave(&fb_ethvlink_vdevs_lock, flags);
+	carrier = fb_ethvlink_carrier_find(real_dev);
+	if (!carrier && new) {
+		new->real_dev = real_dev;
+		list_add(&new->list, &fb_ethvlink_carriers);
+		carrier = new;
+		new = NULL;
+	}
+	spin_unlock_irqrestore(&fb_ethvlink_vdevs_lock, flags);
+
+	kfree(new);
+	return carrier;
+}
+
+/* Frees the carrier once neither hooked nor used, under the vdevs lock */
+static void fb_ethvlink_carrier_put(struct fb_ethvlink_carrier *carrier)
+{
+	if (!carrier || carrier->num > 0 ||
+	    fb_ethvlink_real_dev_is_hooked(carrier->real_dev))
+		return;
+	list_del(&carrier->list);
+	kfree_rcu(carrier, rcu);
+}
+
+static void fb_ethvlink_carrier_release(struct net_device *real_dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&fb_ethvlink_vdevs_lock, flags);
+	fb_ethvlink_carrier_put(fb_ethvlink_carrier_find(real_dev));
+	spin_unlock_irqrestore(&fb_ethvlink_vdevs_lock, flags);
+}
+
 static int fb_ethvlink_event(struct notifier_block *self, unsigned long cmd,
 			     void *args)
 {
 	int ret = NOTIFY_OK;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_ethvlink_private_inner __percpu *fb_priv;
+	struct fb_ethvlink_private_inner *fb_priv;
 
 	rcu_read_lock();
 	fb = rcu_dereference_raw(container_of(self, struct fblock_notifier,
 					      nb)->self);
-	fb_priv = (struct fb_ethvlink_private_inner __percpu *)
+	fb_priv = (struct fb_ethvlink_private_inner *)
 			rcu_dereference_raw(fb->private_data);
 	rcu_read_unlock();
 
 	switch (cmd) {
 	case FBLOCK_BIND_IDP: {
-		int bound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_ethvlink_private_inner *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == IDP_UNKNOWN) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = msg->idp;
-				write_sequnlock(&fb_priv_cpu->lock);
-				bound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fblock_bind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (bound)
-			printk(KERN_INFO "[%s::vlink] port %s bound to IDP%u\n",
-			       fb->name, path_names[msg->dir], msg->idp);
+		printk(KERN_INFO "[%s::vlink] port %s bound to IDP%u\n",
+		       fb->name, path_names[msg->dir], msg->idp);
 		} break;
 	case FBLOCK_UNBIND_IDP: {
-		int unbound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_ethvlink_private_inner *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == msg->idp) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = IDP_UNKNOWN;
-				write_sequnlock(&fb_priv_cpu->lock);
-				unbound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fblock_unbind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (unbound)
-			printk(KERN_INFO "[%s::vlink] port %s unbound\n",
-			       fb->name, path_names[msg->dir]);
+		printk(KERN_INFO "[%s::vlink] port %s unbound\n",
+		       fb->name, path_names[msg->dir]);
+		} break;
+	case FBLOCK_SET_OPT: {
+		struct fblock_opt_msg *msg = args;
+		struct fb_ethvlink_private *vdev;
+		int err;
+		vdev = fb_priv->vdev;
+		err = engine_xmit_set_option(&vdev->xmit, msg->key, msg->val);
+		if (err == -ENOENT)
+			err = engine_steer_set_option(&vdev->steer, msg->key,
+						      msg->val);
+		if (err)
+			ret = NOTIFY_BAD;
+		else
+			printk(KERN_INFO "[%s::vlink] option %s set to %s\n",
+			       fb->name, msg->key, msg->val);
 		} break;
 	default:
 		break;
@@ -201,11 +267,23 @@ static int fb_ethvlink_event(struct notifier_block *self, unsigned long cmd,
 	return ret;
 }
 
+/*
+ * No tag is inserted, frames leave with the caller's ethertype. Thus GSO
+ * skbs and partial checksums go to the real device as they are, and
+ * dev_queue_xmit() or __engine_direct_xmit() only fall back to software
+ * if it lacks the offload. The direct mode keeps our queue, which is the
+ * real device's one, see fb_ethvlink_select_queue(). dev_queue_xmit()
+ * picks again but ends up on the same queue, since it asks the same
+ * ndo_select_queue or skb_tx_hash() over the same number of queues,
+ * unless XPS is set up on the real device.
+ */
 static int fb_ethvlink_queue_xmit(struct sk_buff *skb,
 				  struct net_device *dev)
 {
 	struct fb_ethvlink_private *dev_priv = netdev_priv(dev);
 	skb_set_dev(skb, dev_priv->real_dev);
+	if (ACCESS_ONCE(dev_priv->xmit) == XMIT_DIRECT)
+		return __engine_direct_xmit(skb, skb_get_queue_mapping(skb));
 	return dev_queue_xmit(skb);
 }
 
@@ -213,6 +291,7 @@ netdev_tx_t fb_ethvlink_start_xmit(struct sk_buff *skb,
 				   struct net_device *dev)
 {
 	int ret;
+	unsigned int len = skb->len;
 	struct pcpu_dstats *dstats;
 
 	dstats = this_cpu_ptr(dev->dstats);
@@ -220,7 +299,7 @@ netdev_tx_t fb_ethvlink_start_xmit(struct sk_buff *skb,
 	if (likely(ret == NET_XMIT_SUCCESS || ret == NET_XMIT_CN)) {
 		u64_stats_update_begin(&dstats->syncp);
 		dstats->tx_packets++;
-		dstats->tx_bytes += skb->len;
+		dstats->tx_bytes += len;
 		u64_stats_update_end(&dstats->syncp);
 	} else 
 		this_cpu_inc(dstats->tx_dropped);
@@ -228,36 +307,64 @@ netdev_tx_t fb_ethvlink_start_xmit(struct sk_buff *skb,
 	return ret;
 }
 
+/*
+ * Queue i of ours is queue i of the real device, so we pick the one the
+ * real device would pick for skb.
+ */
+static u16 fb_ethvlink_select_queue(struct net_device *dev,
+				    struct sk_buff *skb)
+{
+	struct fb_ethvlink_private *dev_priv = netdev_priv(dev);
+	struct net_device *real_dev = dev_priv->real_dev;
+	const struct net_device_ops *ops = real_dev->netdev_ops;
+	u16 queue;
+
+	if (ops->ndo_select_queue) {
+		queue = ops->ndo_select_queue(real_dev, skb);
+		if (likely(queue < dev->real_num_tx_queues))
+			return queue;
+		return queue % dev->real_num_tx_queues;
+	}
+
+	return skb_tx_hash(dev, skb);
+}
+
 static int fb_ethvlink_netrx(const struct fblock * const fb,
 			     struct sk_buff * const skb,
 			     enum path_type * const dir)
 {
-	struct fb_ethvlink_private_inner __percpu *fb_priv_cpu;
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference(fb->private_data));
-	skb->dev = fb_priv_cpu->vdev->self;
+	struct fb_ethvlink_private *vdev;
+	struct fb_ethvlink_private_inner *fb_priv;
+	fb_priv = (struct fb_ethvlink_private_inner *)
+			rcu_dereference(fb->private_data);
+	vdev = fb_priv->vdev;
+	skb->dev = vdev->self;
 	write_next_idp_to_skb(skb, fb->idp, IDP_UNKNOWN);
-	dev_queue_xmit(skb);
+	latency_mark_egress(skb);
+	/* Our device has no qdisc, direct mode skips the real device's */
+	if (ACCESS_ONCE(vdev->xmit) == XMIT_DIRECT) {
+		skb_set_queue_mapping(skb, fb_ethvlink_select_queue(vdev->self,
+								    skb));
+		fb_ethvlink_start_xmit(skb, vdev->self);
+	} else
+		dev_queue_xmit(skb);
 	return PPE_DROPPED;
 }
 
 int fb_ethvlink_handle_frame_virt(struct sk_buff *skb,
 				  struct fb_ethvlink_private *vdev)
 {
-	unsigned int seq;
-	struct fb_ethvlink_private_inner __percpu *fb_priv_cpu;
+	idp_t port;
 
 	skb_orphan(skb);
 
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference(vdev->fb->private_data));
-	if (fb_priv_cpu->port[TYPE_INGRESS] == IDP_UNKNOWN)
+	port = fblock_port(vdev->fb, TYPE_INGRESS);
+	if (port == IDP_UNKNOWN)
 		goto drop;
-	do {
-		seq = read_seqbegin(&fb_priv_cpu->lock);
-		write_next_idp_to_skb(skb, vdev->fb->idp,
-				      fb_priv_cpu->port[TYPE_INGRESS]);
-	} while (read_seqretry(&fb_priv_cpu->lock, seq));
+	write_next_idp_to_skb(skb, vdev->fb->idp, port);
 
-        process_packet(skb, TYPE_INGRESS);
+	latency_mark_ingress(skb, vdev->fb->idp);
+	engine_steer_packet(&vdev->steer, skb, TYPE_INGRESS);
 
 	return NET_RX_SUCCESS;
 drop:
@@ -267,10 +374,12 @@ drop:
 
 static rx_handler_result_t fb_ethvlink_handle_frame(struct sk_buff **pskb)
 {
-	int ret, bypass_drop = 0;
+	int ret;
 	u16 vtag;
+	unsigned int len;
 	struct sk_buff *skb = *pskb;
 	struct net_device *dev;
+	struct fb_ethvlink_carrier *carrier;
 	struct fb_ethvlink_private *vdev;
 	struct pcpu_dstats *dstats;
 
@@ -294,26 +403,29 @@ static rx_handler_result_t fb_ethvlink_handle_frame(struct sk_buff **pskb)
 
 	vtag = ntohs(eth_hdr(skb)->h_proto &
 		      ~__constant_htons(ETH_P_LANA));
+	if (unlikely(vtag >= FB_ETHVLINK_TAGS))
+		goto drop;
 
-	list_for_each_entry_rcu(vdev, &fb_ethvlink_vdevs, list) {
-		if (vtag == vdev->tag && dev == vdev->real_dev) {
-			dstats = this_cpu_ptr(vdev->self->dstats);
-			ret = vdev->netvif_rx(skb, vdev);
-			bypass_drop = 1;
-			if (ret == NET_RX_SUCCESS) {
-				u64_stats_update_begin(&dstats->syncp);
-				dstats->rx_packets++;
-				dstats->rx_bytes += skb->len;
-				u64_stats_update_end(&dstats->syncp);
-			} else
-				this_cpu_inc(dstats->rx_errors);
-			break;
-		}
-	}
+	carrier = rcu_dereference(dev->rx_handler_data);
+	vdev = rcu_dereference(carrier->vdev[vtag]);
+	if (unlikely(!vdev))
+		goto drop;
 
+	dstats = this_cpu_ptr(vdev->self->dstats);
+	/* Steering may hand skb to another CPU that frees it */
+	len = skb->len;
+	ret = vdev->netvif_rx(skb, vdev);
+	if (ret == NET_RX_SUCCESS) {
+		u64_stats_update_begin(&dstats->syncp);
+		dstats->rx_packets++;
+		dstats->rx_bytes += len;
+		u64_stats_update_end(&dstats->syncp);
+	} else
+		this_cpu_inc(dstats->rx_errors);
+
+	return RX_HANDLER_CONSUMED;
 drop:
-	if (!bypass_drop)
-		kfree_skb(skb);
+	kfree_skb(skb);
 	return RX_HANDLER_CONSUMED;
 }
 
@@ -324,12 +436,6 @@ static void fb_ethvlink_ethtool_get_drvinfo(struct net_device *dev,
 	snprintf(drvinfo->version, sizeof(drvinfo->version), "0.1");
 }
 
-static u32 fb_ethvlink_ethtool_get_rx_csum(struct net_device *dev)
-{
-	const struct fb_ethvlink_private *vdev = netdev_priv(dev);
-	return dev_ethtool_get_rx_csum(vdev->real_dev);
-}
-
 static int fb_ethvlink_ethtool_get_settings(struct net_device *dev,
 					struct ethtool_cmd *cmd)
 {
@@ -337,10 +443,13 @@ static int fb_ethvlink_ethtool_get_settings(struct net_device *dev,
 	return dev_ethtool_get_settings(vdev->real_dev, cmd);
 }
 
-static u32 fb_ethvlink_ethtool_get_flags(struct net_device *dev)
+/* Offloads the real device does not have are not ours either */
+static u32 fb_ethvlink_fix_features(struct net_device *dev, u32 features)
 {
 	const struct fb_ethvlink_private *vdev = netdev_priv(dev);
-	return dev_ethtool_get_flags(vdev->real_dev);
+	if (!vdev->real_dev)
+		return features & ~FB_ETHVLINK_FEATURES;
+	return features & (vdev->real_dev->features | ~FB_ETHVLINK_FEATURES);
 }
 
 static void fb_ethvlink_dev_setup(struct net_device *dev)
@@ -352,6 +461,9 @@ static void fb_ethvlink_dev_setup(struct net_device *dev)
 	dev->rtnl_link_ops = &fb_ethvlink_rtnl_ops;
 	dev->header_ops = &fb_ethvlink_header_ops;
 	dev->tx_queue_len = 0;
+	/* Per-CPU dstats and the real device's own locking suffice */
+	dev->features |= NETIF_F_LLTX;
+	dev->hw_features = FB_ETHVLINK_FEATURES;
 	dev->priv_flags	&= ~IFF_XMIT_DST_RELEASE;
 	dev->destructor = free_netdev;
 
@@ -414,8 +526,10 @@ fb_ethvlink_get_stats64(struct net_device *dev,
 static void fb_ethvlink_destroy_fblock(struct fblock *fb)
 {
 	unregister_fblock_namespace_no_rcu(fb);
+	/* Engines may still use fb without holding a reference */
+	synchronize_rcu();
 	cleanup_fblock(fb);
-	free_percpu(rcu_dereference_raw(fb->private_data));
+	kfree(rcu_dereference_raw(fb->private_data));
 	kfree_fblock(fb);
 	module_put(THIS_MODULE);
 }
@@ -423,28 +537,18 @@ static void fb_ethvlink_destroy_fblock(struct fblock *fb)
 static struct fblock *fb_ethvlink_build_fblock(struct fb_ethvlink_private *vdev)
 {
 	int ret = 0;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_ethvlink_private_inner __percpu *fb_priv;
+	struct fb_ethvlink_private_inner *fb_priv;
 
 	fb = alloc_fblock(GFP_ATOMIC);
 	if (!fb)
 		return NULL;
 
-	fb_priv = alloc_percpu(struct fb_ethvlink_private_inner);
+	/* The same on all CPUs, so one shared copy does */
+	fb_priv = kzalloc(sizeof(*fb_priv), GFP_ATOMIC);
 	if (!fb_priv)
 		goto err;
-
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		struct fb_ethvlink_private_inner *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-		seqlock_init(&fb_priv_cpu->lock);
-		fb_priv_cpu->port[0] = IDP_UNKNOWN;
-		fb_priv_cpu->port[1] = IDP_UNKNOWN;
-		fb_priv_cpu->vdev = vdev;
-	}
-	put_online_cpus();
+	fb_priv->vdev = vdev;
 
 	ret = init_fblock(fb, vdev->self->name, fb_priv);
 	if (ret)
@@ -462,7 +566,7 @@ static struct fblock *fb_ethvlink_build_fblock(struct fb_ethvlink_private *vdev)
 err3:
 	cleanup_fblock_ctor(fb);
 err2:
-	free_percpu(fb_priv);
+	kfree(fb_priv);
 err:
 	kfree_fblock(fb);
 	fb = NULL;
@@ -476,6 +580,7 @@ static int fb_ethvlink_add_dev(struct vlinknlmsg *vhdr,
 	unsigned long flags;
 	struct net_device *dev;
 	struct net_device *root;
+	struct fb_ethvlink_carrier *carrier;
 	struct fb_ethvlink_private *dev_priv, *vdev;
 
 	if (vhdr->cmd != VLINKNLCMD_ADD_DEVICE)
@@ -502,11 +607,24 @@ static int fb_ethvlink_add_dev(struct vlinknlmsg *vhdr,
 	}
 	rcu_read_unlock();
 
-	dev = alloc_netdev(sizeof(*dev_priv), vhdr->virt_name,
-			   fb_ethvlink_dev_setup);
+	/*
+	 * As many TX queues as the carrier, so that we scale the same way.
+	 * Received frames never enter our RX queues, one will do.
+	 */
+	dev = alloc_netdev_mqs(sizeof(*dev_priv), vhdr->virt_name,
+			       fb_ethvlink_dev_setup, root->num_tx_queues, 1);
 	if (!dev)
 		goto err_put;
 
+	ret = netif_set_real_num_tx_queues(dev, root->real_num_tx_queues);
+	if (ret)
+		goto err_free;
+
+	/* Needed by fix_features on registration already */
+	dev_priv = netdev_priv(dev);
+	dev_priv->real_dev = root;
+	dev->features |= root->features & FB_ETHVLINK_FEATURES;
+
 	ret = dev_alloc_name(dev, dev->name);
 	if (ret)
 		goto err_free;
@@ -515,22 +633,29 @@ static int fb_ethvlink_add_dev(struct vlinknlmsg *vhdr,
 	if (ret)
 		goto err_free;
 
-	dev_priv = netdev_priv(dev);
 	dev->priv_flags |= vhdr->flags;
 	dev->priv_flags |= IFF_VLINK_DEV;
 	dev_priv->tag = vhdr->port;
 	dev_priv->self = dev;
-	dev_priv->real_dev = root;
 	dev_priv->netvif_rx = fb_ethvlink_handle_frame_virt;
+	dev_priv->xmit = XMIT_QUEUE;
+	engine_steer_init(&dev_priv->steer);
 	dev_priv->fb = fb_ethvlink_build_fblock(dev_priv);
 	if (!dev_priv->fb)
 		goto err_unreg;
+	carrier = fb_ethvlink_carrier_get(root);
+	if (!carrier) {
+		fb_ethvlink_destroy_fblock(dev_priv->fb);
+		goto err_unreg;
+	}
 
 	netif_stacked_transfer_operstate(dev_priv->real_dev, dev);
 	dev_put(dev_priv->real_dev);
 
 	spin_lock_irqsave(&fb_ethvlink_vdevs_lock, flags);
 	list_add_rcu(&dev_priv->list, &fb_ethvlink_vdevs);
+	rcu_assign_pointer(carrier->vdev[dev_priv->tag], dev_priv);
+	carrier->num++;
 	spin_unlock_irqrestore(&fb_ethvlink_vdevs_lock, flags);
 
 	netif_tx_lock_bh(dev);
@@ -558,6 +683,7 @@ static int fb_ethvlink_start_hook_dev(struct vlinknlmsg *vhdr,
 {
 	int ret;
 	struct net_device *root;
+	struct fb_ethvlink_carrier *carrier;
 
 	if (vhdr->cmd != VLINKNLCMD_START_HOOK_DEVICE)
 		return NETLINK_VLINK_RX_NXT;
@@ -573,12 +699,18 @@ static int fb_ethvlink_start_hook_dev(struct vlinknlmsg *vhdr,
 	if (fb_ethvlink_real_dev_is_hooked(root))
 		goto out;
 
+	carrier = fb_ethvlink_carrier_get(root);
+	if (!carrier)
+		goto err;
+
 	rtnl_lock();
 	ret = netdev_rx_handler_register(root, fb_ethvlink_handle_frame,
-					 NULL);
+					 carrier);
 	rtnl_unlock();
-	if (ret)
+	if (ret) {
+		fb_ethvlink_carrier_release(root);
 		goto err;
+	}
 
 	fb_ethvlink_make_real_dev_hooked(root);
 	printk(KERN_INFO "[lana] hook attached to carrier %s\n",
@@ -613,6 +745,7 @@ static int fb_ethvlink_stop_hook_dev(struct vlinknlmsg *vhdr,
 	rtnl_unlock();
 
 	fb_ethvlink_make_real_dev_unhooked(root);
+	fb_ethvlink_carrier_release(root);
 	printk(KERN_INFO "[lana] hook detached from carrier %s\n",
 	       vhdr->real_name);
 out:
@@ -623,7 +756,7 @@ err:
 	return NETLINK_VLINK_RX_EMERG;
 }
 
-static void fb_ethvlink_rm_dev_common(struct net_device *dev)
+static void __fb_ethvlink_rm_dev_common(struct net_device *dev)
 {
 	netif_tx_lock_bh(dev);
 	netif_carrier_off(dev);
@@ -631,38 +764,24 @@ static void fb_ethvlink_rm_dev_common(struct net_device *dev)
 
 	printk(KERN_INFO "[lana] %s unregistered\n", dev->name);
 
-	rtnl_lock();
 	unregister_netdevice(dev);
+}
+
+static void fb_ethvlink_rm_dev_common(struct net_device *dev)
+{
+	rtnl_lock();
+	__fb_ethvlink_rm_dev_common(dev);
 	rtnl_unlock();
 }
 
-static int fb_ethvlink_rm_dev(struct vlinknlmsg *vhdr, struct nlmsghdr *nlh)
+/* Tears dev_priv down, may sleep. Called under rtnl. */
+static void __fb_ethvlink_rm_dev(struct fb_ethvlink_private *dev_priv)
 {
-	int count;
+	int count = 0;
 	unsigned long flags;
-	struct fb_ethvlink_private *dev_priv, *vdev;
-	struct net_device *dev;
-
-	if (vhdr->cmd != VLINKNLCMD_RM_DEVICE)
-		return NETLINK_VLINK_RX_NXT;
-
-	dev = dev_get_by_name(&init_net, vhdr->virt_name);
-	if (!dev)
-		return NETLINK_VLINK_RX_EMERG;
-	if ((dev->priv_flags & IFF_VLINK_DEV) != IFF_VLINK_DEV)
-		goto err_put;
-	if ((dev->flags & IFF_RUNNING) == IFF_RUNNING)
-		goto err_put;
-	dev_priv = netdev_priv(dev);
-	if (atomic_read(&dev_priv->fb->refcnt) > 2) {
-		printk(KERN_INFO "Cannot remove vlink dev! Still in use by "
-		       "others!\n");
-		goto err_put;
-	}
-
-	dev_put(dev);
+	struct fb_ethvlink_carrier *carrier;
+	struct fb_ethvlink_private *vdev;
 
-	count = 0;
 	rcu_read_lock();
 	list_for_each_entry_rcu(vdev, &fb_ethvlink_vdevs, list)
 		if (dev_priv->real_dev == vdev->real_dev)
@@ -672,9 +791,7 @@ static int fb_ethvlink_rm_dev(struct vlinknlmsg *vhdr, struct nlmsghdr *nlh)
 	if (count == 1) {
 		/* We're last client on carrier! */
 		if (fb_ethvlink_real_dev_is_hooked(dev_priv->real_dev)) {
-			rtnl_lock();
 			netdev_rx_handler_unregister(dev_priv->real_dev);
-			rtnl_unlock();
 
 			fb_ethvlink_make_real_dev_unhooked(dev_priv->real_dev);
 			printk(KERN_INFO "[lana] hook detached from %s\n",
@@ -684,10 +801,65 @@ static int fb_ethvlink_rm_dev(struct vlinknlmsg *vhdr, struct nlmsghdr *nlh)
 
 	spin_lock_irqsave(&fb_ethvlink_vdevs_lock, flags);
 	list_del_rcu(&dev_priv->list);
+	carrier = fb_ethvlink_carrier_find(dev_priv->real_dev);
+	if (carrier) {
+		RCU_INIT_POINTER(carrier->vdev[dev_priv->tag], NULL);
+		carrier->num--;
+		fb_ethvlink_carrier_put(carrier);
+	}
 	spin_unlock_irqrestore(&fb_ethvlink_vdevs_lock, flags);
 
 	fb_ethvlink_destroy_fblock(dev_priv->fb);
-	fb_ethvlink_rm_dev_common(dev);
+	engine_steer_destroy(&dev_priv->steer);
+	__fb_ethvlink_rm_dev_common(dev_priv->self);
+}
+
+/*
+ * Puts all vdevs on real_dev onto head, so that they can be worked on
+ * without holding the vdevs lock. Called under rtnl, which keeps them
+ * from being freed until it is released.
+ */
+static void fb_ethvlink_collect_vdevs(struct net_device *real_dev,
+				      struct list_head *head)
+{
+	unsigned long flags;
+	struct fb_ethvlink_private *vdev;
+
+	spin_lock_irqsave(&fb_ethvlink_vdevs_lock, flags);
+	list_for_each_entry(vdev, &fb_ethvlink_vdevs, list)
+		if (vdev->real_dev == real_dev)
+			list_add_tail(&vdev->batch, head);
+	spin_unlock_irqrestore(&fb_ethvlink_vdevs_lock, flags);
+}
+
+static int fb_ethvlink_rm_dev(struct vlinknlmsg *vhdr, struct nlmsghdr *nlh)
+{
+	struct fb_ethvlink_private *dev_priv;
+	struct net_device *dev;
+
+	if (vhdr->cmd != VLINKNLCMD_RM_DEVICE)
+		return NETLINK_VLINK_RX_NXT;
+
+	dev = dev_get_by_name(&init_net, vhdr->virt_name);
+	if (!dev)
+		return NETLINK_VLINK_RX_EMERG;
+	if ((dev->priv_flags & IFF_VLINK_DEV) != IFF_VLINK_DEV)
+		goto err_put;
+	if ((dev->flags & IFF_RUNNING) == IFF_RUNNING)
+		goto err_put;
+	dev_priv = netdev_priv(dev);
+	if (atomic_read(&dev_priv->fb->refcnt) > 2) {
+		printk(KERN_INFO "Cannot remove vlink dev! Still in use by "
+		       "others!\n");
+		goto err_put;
+	}
+
+	rtnl_lock();
+	dev_put(dev);
+	/* It may have gone along with its carrier meanwhile */
+	if (dev->reg_state == NETREG_REGISTERED)
+		__fb_ethvlink_rm_dev(dev_priv);
+	rtnl_unlock();
 
 	return NETLINK_VLINK_RX_STOP;
 
@@ -699,10 +871,9 @@ err_put:
 static int fb_ethvlink_dev_event(struct notifier_block *self,
 				 unsigned long event, void *ptr)
 {
-	unsigned long flags;
 	struct net_device *dev = ptr;
-	struct fb_ethvlink_private *vdev;
-	struct vlinknlmsg vhdr;
+	struct fb_ethvlink_private *vdev, *tmp;
+	LIST_HEAD(batch);
 
 	if (!dev)
 		return NOTIFY_DONE;
@@ -717,25 +888,19 @@ static int fb_ethvlink_dev_event(struct notifier_block *self,
 		rcu_read_unlock();
 		break;
 	case NETDEV_FEAT_CHANGE:
-		/* Nothing right now */
+		/* Feature updates notify others and may sleep */
+		fb_ethvlink_collect_vdevs(dev, &batch);
+		list_for_each_entry(vdev, &batch, batch)
+			netdev_update_features(vdev->self);
 		break;
 	case NETDEV_UNREGISTER:
 		if (dev->reg_state != NETREG_UNREGISTERING)
 			break;
 
-		memset(&vhdr, 0, sizeof(vhdr));
-		vhdr.cmd = VLINKNLCMD_RM_DEVICE;
-		spin_lock_irqsave(&fb_ethvlink_vdevs_lock, flags);
-		list_for_each_entry_rcu(vdev, &fb_ethvlink_vdevs, list) {
-			if (vdev->real_dev == dev) {
-				memset(vhdr.virt_name, 0,
-				       sizeof(vhdr.virt_name));
-				strlcpy(vhdr.virt_name, vdev->self->name,
-					strlen(vdev->self->name));
-				fb_ethvlink_rm_dev(&vhdr, NULL);
-			}
-		}
-		spin_unlock_irqrestore(&fb_ethvlink_vdevs_lock, flags);
+		/* Teardown sleeps, hence not under the vdevs lock */
+		fb_ethvlink_collect_vdevs(dev, &batch);
+		list_for_each_entry_safe(vdev, tmp, &batch, batch)
+			__fb_ethvlink_rm_dev(vdev);
 		break;
 	case NETDEV_PRE_TYPE_CHANGE:
 		return NOTIFY_BAD;
@@ -749,9 +914,7 @@ static int fb_ethvlink_dev_event(struct notifier_block *self,
 static struct ethtool_ops fb_ethvlink_ethtool_ops __read_mostly = {
 	.get_link            = ethtool_op_get_link,
 	.get_settings        = fb_ethvlink_ethtool_get_settings,
-	.get_rx_csum         = fb_ethvlink_ethtool_get_rx_csum,
 	.get_drvinfo         = fb_ethvlink_ethtool_get_drvinfo,
-	.get_flags           = fb_ethvlink_ethtool_get_flags,
 };
 
 static struct net_device_ops fb_ethvlink_netdev_ops __read_mostly = {
@@ -760,6 +923,8 @@ static struct net_device_ops fb_ethvlink_netdev_ops __read_mostly = {
 	.ndo_open            = fb_ethvlink_open,
 	.ndo_stop            = fb_ethvlink_stop,
 	.ndo_start_xmit      = fb_ethvlink_start_xmit,
+	.ndo_select_queue    = fb_ethvlink_select_queue,
+	.ndo_fix_features    = fb_ethvlink_fix_features,
 	.ndo_get_stats64     = fb_ethvlink_get_stats64,
 	.ndo_change_mtu      = eth_change_mtu,
 	.ndo_set_mac_address = eth_mac_addr,
@@ -830,24 +995,38 @@ err:
 
 static void __exit cleanup_fb_ethvlink_module(void)
 {
+	unsigned long flags;
 	struct fb_ethvlink_private *vdev;
+	struct fb_ethvlink_carrier *carrier, *tmp;
 
-	rcu_read_lock();
-	list_for_each_entry_rcu(vdev, &fb_ethvlink_vdevs, list) {
-		if (fb_ethvlink_real_dev_is_hooked(vdev->real_dev)) {
-			rtnl_lock();
-			netdev_rx_handler_unregister(vdev->real_dev);
-			rtnl_unlock();
+	/* Every carrier, also those only hooked without vdevs on them */
+	rtnl_lock();
+	spin_lock_irqsave(&fb_ethvlink_vdevs_lock, flags);
+	list_for_each_entry(carrier, &fb_ethvlink_carriers, list) {
+		if (!fb_ethvlink_real_dev_is_hooked(carrier->real_dev))
+			continue;
+		netdev_rx_handler_unregister(carrier->real_dev);
+
+		fb_ethvlink_make_real_dev_unhooked(carrier->real_dev);
+		printk(KERN_INFO "[lana] hook detached from %s\n",
+		       carrier->real_dev->name);
+	}
+	spin_unlock_irqrestore(&fb_ethvlink_vdevs_lock, flags);
+	rtnl_unlock();
 
-			fb_ethvlink_make_real_dev_unhooked(vdev->real_dev);
-			printk(KERN_INFO "[lana] hook detached from %s\n",
-			       vdev->real_dev->name);
-		}
+	/* netdev_rx_handler_unregister() does not wait for its readers */
+	synchronize_net();
 
+	rcu_read_lock();
+	list_for_each_entry_rcu(vdev, &fb_ethvlink_vdevs, list)
 		fb_ethvlink_rm_dev_common(vdev->self);
-	}
 	rcu_read_unlock();
 
+	list_for_each_entry_safe(carrier, tmp, &fb_ethvlink_carriers, list) {
+		list_del(&carrier->list);
+		kfree(carrier);
+	}
+
 	unregister_netdevice_notifier(&fb_ethvlink_notifier_block);
 	rtnl_link_unregister(&fb_ethvlink_rtnl_ops);
 	vlink_subsys_unregister_batch(&fb_ethvlink_sys);
@@ -14,7 +14,6 @@
 #include <linux/spinlock.h>
 #include <linux/notifier.h>
 #include <linux/rcupdate.h>
-#include <linux/seqlock.h>
 #include <linux/bug.h>
 #include <linux/percpu.h>
 #include <linux/prefetch.h>
@@ -28,6 +27,7 @@
 #include "xt_skb.h"
 #include "xt_engine.h"
 #include "xt_builder.h"
+#include "xt_latency.h"
 
 #define AF_LANA         27      /* For now.. */
 #define PF_LANA         AF_LANA
@@ -46,9 +46,8 @@ struct lana_protocol {
 	struct module *owner;
 };
 
+/* Read-only after creation, hence shared by all CPUs */
 struct fb_pflana_priv {
-	idp_t port[2];
-	seqlock_t lock;
 	struct lana_sock *sock_self;
 };
 
@@ -70,11 +69,12 @@ static int fb_pflana_netrx(const struct fblock * const fb,
 	u8 *skb_head = skb->data;
 	int skb_len = skb->len;
 	struct sock *sk;
-	struct fb_pflana_priv __percpu *fb_priv_cpu;
+	struct fb_pflana_priv *fb_priv;
 
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference_raw(fb->private_data));
-	sk = &fb_priv_cpu->sock_self->sk;
+	fb_priv = (struct fb_pflana_priv *) rcu_dereference_raw(fb->private_data);
+	sk = &fb_priv->sock_self->sk;
 
+	latency_mark_egress(skb);
 	if (skb_shared(skb)) {
 		struct sk_buff *nskb = skb_clone(skb, GFP_ATOMIC);
 		if (skb_head != skb->data) {
@@ -97,61 +97,31 @@ static int fb_pflana_event(struct notifier_block *self, unsigned long cmd,
 			   void *args)
 {
 	int ret = NOTIFY_OK;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_pflana_priv __percpu *fb_priv;
 
 	rcu_read_lock();
 	fb = rcu_dereference_raw(container_of(self, struct fblock_notifier,
 					      nb)->self);
-	fb_priv = (struct fb_pflana_priv __percpu *)
-			rcu_dereference_raw(fb->private_data);
 	rcu_read_unlock();
 
 	switch (cmd) {
 	case FBLOCK_BIND_IDP: {
-		int bound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_pflana_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == IDP_UNKNOWN) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = msg->idp;
-				write_sequnlock(&fb_priv_cpu->lock);
-				bound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fblock_bind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (bound)
-			printk(KERN_INFO "[%s::bsdsock] port %s bound to IDP%u\n",
-			       fb->name, path_names[msg->dir], msg->idp);
+		printk(KERN_INFO "[%s::bsdsock] port %s bound to IDP%u\n",
+		       fb->name, path_names[msg->dir], msg->idp);
 		} break;
 	case FBLOCK_UNBIND_IDP: {
-		int unbound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_pflana_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == msg->idp) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = IDP_UNKNOWN;
-				write_sequnlock(&fb_priv_cpu->lock);
-				unbound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fblock_unbind_port(fb, msg->port, msg->idp)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (unbound)
-			printk(KERN_INFO "[%s::bsdsock] port %s unbound\n",
-			       fb->name, path_names[msg->dir]);
+		printk(KERN_INFO "[%s::bsdsock] port %s unbound\n",
+		       fb->name, path_names[msg->dir]);
 		} break;
 	default:
 		break;
@@ -164,13 +134,9 @@ static struct fblock *get_bound_fblock(struct fblock *self,
 				       enum path_type dir)
 {
 	idp_t fbidp;
-	unsigned int seq;
-	struct fb_pflana_priv __percpu *fb_priv_cpu;
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference_raw(self->private_data));
-	do {
-		seq = read_seqbegin(&fb_priv_cpu->lock);
-                fbidp = fb_priv_cpu->port[dir];
-	} while (read_seqretry(&fb_priv_cpu->lock, seq));
+	rcu_read_lock();
+	fbidp = fblock_port(self, dir);
+	rcu_read_unlock();
 	return search_fblock(fbidp);
 }
 
@@ -183,8 +149,8 @@ static struct fblock *fb_pflana_build_fblock(char *name);
 
 static int lana_sk_init(struct sock* sk)
 {
-	int cpu;
 	char name[32];
+	struct fb_pflana_priv *fb_priv;
 	struct lana_sock *lana = to_lana_sk(sk);
 
 	memset(name, 0, sizeof(name));
@@ -192,13 +158,8 @@ static int lana_sk_init(struct sock* sk)
 	lana->fb = fb_pflana_build_fblock(name);
 	if (!lana->fb)
 		return -ENOMEM;
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		struct fb_pflana_priv *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(lana->fb->private_data, cpu);
-		fb_priv_cpu->sock_self = lana;
-	}
-	put_online_cpus();
+	fb_priv = (struct fb_pflana_priv *) rcu_dereference_raw(lana->fb->private_data);
+	fb_priv->sock_self = lana;
 	smp_wmb();
 	return 0;
 }
@@ -282,14 +243,12 @@ static int lana_proto_sendmsg(struct kiocb *iocb, struct sock *sk,
 			      struct msghdr *msg, size_t len)
 {
 	int err;
-	unsigned int seq;
 	struct net *net = sock_net(sk);
 	struct net_device *dev;
 	struct sockaddr *target;
 	struct sk_buff *skb;
 	struct lana_sock *lana = to_lana_sk(sk);
 	struct fblock *fb = lana->fb;
-	struct fb_pflana_priv *fb_priv_cpu;
 
 	if (msg->msg_name == NULL)
 		return -EDESTADDRREQ;
@@ -335,13 +294,9 @@ static int lana_proto_sendmsg(struct kiocb *iocb, struct sock *sk,
 	dev_put(dev);
 
 	rcu_read_lock();
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference(fb->private_data));
-	do {
-		seq = read_seqbegin(&fb_priv_cpu->lock);
-		write_next_idp_to_skb(skb, fb->idp,
-				      fb_priv_cpu->port[TYPE_EGRESS]);
-        } while (read_seqretry(&fb_priv_cpu->lock, seq));
+	write_next_idp_to_skb(skb, fb->idp, fblock_port(fb, TYPE_EGRESS));
 
+	latency_mark_ingress(skb, fb->idp);
         process_packet(skb, TYPE_EGRESS);
 	rcu_read_unlock();
 
@@ -681,25 +636,15 @@ static void cleanup_fb_pflana(void)
 static struct fblock *fb_pflana_build_fblock(char *name)
 {
 	int ret = 0;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_pflana_priv __percpu *fb_priv;
+	struct fb_pflana_priv *fb_priv;
 
 	fb = alloc_fblock(GFP_ATOMIC);
 	if (!fb)
 		return NULL;
-	fb_priv = alloc_percpu(struct fb_pflana_priv);
+	fb_priv = kzalloc(sizeof(*fb_priv), GFP_ATOMIC);
 	if (!fb_priv)
 		goto err;
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		struct fb_pflana_priv *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-		seqlock_init(&fb_priv_cpu->lock);
-		fb_priv_cpu->port[0] = IDP_UNKNOWN;
-		fb_priv_cpu->port[1] = IDP_UNKNOWN;
-	}
-	put_online_cpus();
 
 	ret = init_fblock(fb, name, fb_priv);
 	if (ret)
@@ -715,7 +660,7 @@ static struct fblock *fb_pflana_build_fblock(char *name)
 err3:
 	cleanup_fblock_ctor(fb);
 err2:
-	free_percpu(fb_priv);
+	kfree(fb_priv);
 err:
 	kfree_fblock(fb);
 	fb = NULL;
@@ -725,8 +670,10 @@ err:
 static void fb_pflana_destroy_fblock(struct fblock *fb)
 {
 	unregister_fblock_namespace_no_rcu(fb);
+	/* Engines may still use fb without holding a reference */
+	synchronize_rcu();
 	cleanup_fblock(fb);
-	free_percpu(rcu_dereference_raw(fb->private_data));
+	kfree(rcu_dereference_raw(fb->private_data));
 	kfree_fblock(fb);
 	module_put(THIS_MODULE);
 }
@@ -13,7 +13,6 @@
 #include <linux/spinlock.h>
 #include <linux/notifier.h>
 #include <linux/rcupdate.h>
-#include <linux/seqlock.h>
 #include <linux/percpu.h>
 #include <linux/prefetch.h>
 
@@ -24,116 +23,121 @@
 #include "xt_engine.h"
 #include "xt_builder.h"
 
-struct fb_tee_priv {
-	idp_t port[2];
-	idp_t port_clone;
-	seqlock_t lock;
-};
+/* Fanout ports behind the per path type ones */
+#define FB_TEE_PORTS		16
+
+/* Collects the path type's port and all fanout ports into idps. */
+static inline unsigned int fb_tee_fanout_ports(const struct fblock * const fb,
+					       enum path_type dir,
+					       idp_t *idps)
+{
+	unsigned int i, num = 0;
+	struct fblock_ports *ports = rcu_dereference_raw(fb->ports);
+
+	idps[num++] = ports->port[dir];
+	for (i = NUM_TYPES; i < ports->num; ++i)
+		idps[num++] = ports->port[i];
+
+	return num;
+}
 
 static int fb_tee_netrx(const struct fblock * const fb,
 			struct sk_buff * const skb,
 			enum path_type * const dir)
 {
-	idp_t port_clone = 0;
-	int drop = 0;
-	unsigned int seq;
-	struct sk_buff *cloned_skb = NULL;
-	struct fb_tee_priv __percpu *fb_priv_cpu;
+	unsigned int num;
+	idp_t idps[FB_TEE_PORTS];
 
-	fb_priv_cpu = this_cpu_ptr(rcu_dereference_raw(fb->private_data));
 	prefetchw(skb->cb);
-	do {
-		seq = read_seqbegin(&fb_priv_cpu->lock);
-		write_next_idp_to_skb(skb, fb->idp, fb_priv_cpu->port[*dir]);
-		if (fb_priv_cpu->port[*dir] == IDP_UNKNOWN)
-			drop = 1;
-		if (fb_priv_cpu->port_clone != IDP_UNKNOWN)
-			port_clone = fb_priv_cpu->port_clone;
-	} while (read_seqretry(&fb_priv_cpu->lock, seq));
-
-	if (port_clone != 0) {
-		cloned_skb = skb_copy(skb, GFP_ATOMIC);
-		if (cloned_skb) {
-			write_next_idp_to_skb(cloned_skb, fb->idp, port_clone);
-			engine_backlog_tail(cloned_skb, *dir);
-		}
-	}
-	if (drop) {
+	num = fb_tee_fanout_ports(fb, *dir, idps);
+	if (!engine_fanout(fb, skb, idps, num, *dir)) {
 		kfree_skb(skb);
 		return PPE_DROPPED;
 	}
 	return PPE_SUCCESS;
 }
 
+static void fb_tee_netrx_bulk(const struct fblock * const fb,
+			      struct sk_buff ** const skbs,
+			      int * const rets, unsigned int num,
+			      enum path_type * const dir)
+{
+	unsigned int i, num_idps;
+	idp_t idps[FB_TEE_PORTS];
+
+	num_idps = fb_tee_fanout_ports(fb, *dir, idps);
+	for (i = 0; i < num; ++i) {
+		if (!engine_fanout(fb, skbs[i], idps, num_idps, *dir)) {
+			kfree_skb(skbs[i]);
+			rets[i] = PPE_DROPPED;
+			continue;
+		}
+		rets[i] = PPE_SUCCESS;
+	}
+}
+
+/*
+ * Plain binds that find the path type's port taken go to the first free
+ * fanout port, so that tee keeps working with fblock_bind().
+ */
+static int fb_tee_bind(struct fblock *fb, struct fblock_bind_msg *msg)
+{
+	unsigned int i;
+
+	if (!fblock_bind_port(fb, msg->port, msg->idp))
+		return 0;
+	if (msg->port != msg->dir)
+		return -EBUSY;
+	for (i = NUM_TYPES; i < FB_TEE_PORTS; ++i)
+		if (!fblock_bind_port(fb, i, msg->idp))
+			return 0;
+	return -EBUSY;
+}
+
+static int fb_tee_unbind(struct fblock *fb, struct fblock_bind_msg *msg)
+{
+	unsigned int i;
+
+	if (!fblock_unbind_port(fb, msg->port, msg->idp))
+		return 0;
+	if (msg->port != msg->dir)
+		return -ENOENT;
+	for (i = NUM_TYPES; i < FB_TEE_PORTS; ++i)
+		if (!fblock_unbind_port(fb, i, msg->idp))
+			return 0;
+	return -ENOENT;
+}
+
 static int fb_tee_event(struct notifier_block *self, unsigned long cmd,
 			void *args)
 {
 	int ret = NOTIFY_OK;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_tee_priv __percpu *fb_priv;
 
 	rcu_read_lock();
 	fb = rcu_dereference_raw(container_of(self, struct fblock_notifier, nb)->self);
-	fb_priv = (struct fb_tee_priv __percpu *) rcu_dereference_raw(fb->private_data);
 	rcu_read_unlock();
 
 	switch (cmd) {
 	case FBLOCK_BIND_IDP: {
-		int bound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_tee_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == IDP_UNKNOWN) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = msg->idp;
-				write_sequnlock(&fb_priv_cpu->lock);
-				bound = 1;
-			} else if (fb_priv_cpu->port_clone == IDP_UNKNOWN) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port_clone = msg->idp;
-				write_sequnlock(&fb_priv_cpu->lock);
-				bound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fb_tee_bind(fb, msg)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (bound)
-			printk(KERN_INFO "[%s::%s] port %s bound to IDP%u\n",
-			       fb->name, fb->factory->type,
-			       path_names[msg->dir], msg->idp);
+		printk(KERN_INFO "[%s::%s] port %s bound to IDP%u\n",
+		       fb->name, fb->factory->type,
+		       path_names[msg->dir], msg->idp);
 		} break;
 	case FBLOCK_UNBIND_IDP: {
-		int unbound = 0;
 		struct fblock_bind_msg *msg = args;
-		get_online_cpus();
-		for_each_online_cpu(cpu) {
-			struct fb_tee_priv *fb_priv_cpu;
-			fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-			if (fb_priv_cpu->port[msg->dir] == msg->idp) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port[msg->dir] = IDP_UNKNOWN;
-				write_sequnlock(&fb_priv_cpu->lock);
-				unbound = 1;
-			} else if (fb_priv_cpu->port_clone == msg->idp) {
-				write_seqlock(&fb_priv_cpu->lock);
-				fb_priv_cpu->port_clone = IDP_UNKNOWN;
-				write_sequnlock(&fb_priv_cpu->lock);
-				unbound = 1;
-			} else {
-				ret = NOTIFY_BAD;
-				break;
-			}
+		if (fb_tee_unbind(fb, msg)) {
+			ret = NOTIFY_BAD;
+			break;
 		}
-		put_online_cpus();
-		if (unbound)
-			printk(KERN_INFO "[%s::%s] port %s unbound\n",
-			       fb->name, fb->factory->type,
-			       path_names[msg->dir]);
+		printk(KERN_INFO "[%s::%s] port %s unbound\n",
+		       fb->name, fb->factory->type,
+		       path_names[msg->dir]);
 		} break;
 	case FBLOCK_SET_OPT: {
 		struct fblock_opt_msg *msg = args;
@@ -149,43 +153,25 @@ static int fb_tee_event(struct notifier_block *self, unsigned long cmd,
 static struct fblock *fb_tee_ctor(char *name)
 {
 	int ret = 0;
-	unsigned int cpu;
 	struct fblock *fb;
-	struct fb_tee_priv __percpu *fb_priv;
 
 	fb = alloc_fblock(GFP_ATOMIC);
 	if (!fb)
 		return NULL;
 
-	fb_priv = alloc_percpu(struct fb_tee_priv);
-	if (!fb_priv)
-		goto err;
-
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		struct fb_tee_priv *fb_priv_cpu;
-		fb_priv_cpu = per_cpu_ptr(fb_priv, cpu);
-		seqlock_init(&fb_priv_cpu->lock);
-		fb_priv_cpu->port[0] = IDP_UNKNOWN;
-		fb_priv_cpu->port[1] = IDP_UNKNOWN;
-		fb_priv_cpu->port_clone = IDP_UNKNOWN;
-	}
-	put_online_cpus();
-
-	ret = init_fblock(fb, name, fb_priv);
+	ret = init_fblock_ports(fb, name, NULL, FB_TEE_PORTS);
 	if (ret)
-		goto err2;
+		goto err;
 	fb->netfb_rx = fb_tee_netrx;
+	fb->netfb_rx_bulk = fb_tee_netrx_bulk;
 	fb->event_rx = fb_tee_event;
 	ret = register_fblock_namespace(fb);
 	if (ret)
-		goto err3;
+		goto err2;
 	__module_get(THIS_MODULE);
 	return fb;
-err3:
-	cleanup_fblock_ctor(fb);
 err2:
-	free_percpu(fb_priv);
+	cleanup_fblock_ctor(fb);
 err:
 	kfree_fblock(fb);
 	return NULL;
@@ -193,7 +179,6 @@ err:
 
 static void fb_tee_dtor(struct fblock *fb)
 {
-	free_percpu(rcu_dereference_raw(fb->private_data));
 	module_put(THIS_MODULE);
 }
 
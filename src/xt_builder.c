@@ -48,6 +48,12 @@ struct fblock *build_fblock_object(char *type, char *name)
 }
 EXPORT_SYMBOL(build_fblock_object);
 
+int fblock_type_registered(char *type)
+{
+	return critbit_get(&fbmap, type) != NULL;
+}
+EXPORT_SYMBOL_GPL(fblock_type_registered);
+
 int init_fblock_builder(void)
 {
 	get_critbit_cache();
@@ -14,6 +14,7 @@
 extern int register_fblock_type(struct fblock_factory *fops);
 extern void unregister_fblock_type(struct fblock_factory *fops);
 extern struct fblock *build_fblock_object(char *type, char *name);
+extern int fblock_type_registered(char *type);
 extern int init_fblock_builder(void);
 extern void cleanup_fblock_builder(void);
 
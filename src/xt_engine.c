@@ -14,50 +14,170 @@
 #include <linux/cache.h>
 #include <linux/proc_fs.h>
 #include <linux/rcupdate.h>
-#include <linux/hrtimer.h>
 #include <linux/interrupt.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/smp.h>
+#include <linux/bitops.h>
+#include <linux/cpumask.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/etherdevice.h>
+#include <linux/jump_label.h>
+#include <linux/mutex.h>
+#include <asm/timex.h>
 
 #include "xt_engine.h"
 #include "xt_skb.h"
 #include "xt_fblock.h"
 
-struct engine_iostats {
-	unsigned long long bytes;
-	unsigned long long pkts;
-	unsigned long long fblocks;
-	unsigned long long timer;
-	unsigned long long timer_cpu_miss;
-} ____cacheline_aligned;
+#define ENGINE_PATHS_BITS	5
+#define ENGINE_PATHS		(1 << ENGINE_PATHS_BITS)
+#define ENGINE_PATH_HOPS	16
+
+/*
+ * Compiled path of skbs that entered the graph at src. Hop i holds the
+ * fblock that skbs reach after i hops, valid as long as the topology
+ * generation did not change. Entries do not hold a reference, the
+ * fblocks are kept alive by RCU while the engine runs.
+ */
+struct engine_path {
+	idp_t src;
+	unsigned int gen;
+	unsigned int len;
+	struct {
+		idp_t idp;
+		struct fblock *fb;
+	} hop[ENGINE_PATH_HOPS];
+};
+
+struct engine_paths {
+	struct engine_path path[ENGINE_PATHS];
+};
+
+/*
+ * Backlog ring for skbs queued on the owning CPU. Producer and consumer
+ * both run on the owning CPU with BHs disabled, so no atomics are needed.
+ */
+struct engine_ring {
+	struct sk_buff **slot;
+	unsigned int mask;
+	unsigned int head;
+	unsigned int tail;
+};
+
+struct engine_mpsc_cell {
+	atomic_t seq;
+	struct sk_buff *skb;
+};
+
+/*
+ * Backlog ring for skbs handed over from other CPUs. Multiple producers
+ * reserve cells via cmpxchg on tail, the owning CPU is the only consumer.
+ */
+struct engine_mpsc {
+	struct engine_mpsc_cell *cell;
+	unsigned int mask;
+	atomic_t tail ____cacheline_aligned_in_smp;
+	unsigned int head ____cacheline_aligned_in_smp;
+};
+
+#define ENGINE_DISC_KICKED	0
+
+/* Flows are handed over to other engines in units of rxhash buckets */
+#define ENGINE_STEAL_BUCKETS	64
+#define ENGINE_STEAL_PER_RUN	4
 
 struct engine_disc {
-	struct sk_buff_head ppe_backlog_queue;
-	struct tasklet_hrtimer htimer;
+	struct engine_ring ppe_backlog_ring;
+	struct engine_mpsc ppe_backlog_mpsc;
+	struct tasklet_struct ppe_backlog_tasklet;
+	struct call_single_data csd;
+	unsigned long state;
+	unsigned int hiwat;
 	int active, cpu;
+	/* Engine that currently processes a bucket for us, or -1 */
+	int steal_owner[ENGINE_STEAL_BUCKETS];
+	unsigned int nr_stolen;
+	/* Number of buckets we process on behalf of other engines */
+	atomic_t nr_thieving;
 } ____cacheline_aligned;
 
+/* Number of slots of each per-CPU backlog ring, rounded to a power of 2 */
+static unsigned int ppe_backlog_len __read_mostly = 1024;
+module_param(ppe_backlog_len, uint, 0444);
+MODULE_PARM_DESC(ppe_backlog_len, "Slots per PPE backlog ring");
+
+/* Max. number of backlog skbs processed in one go before we yield */
+static unsigned int ppe_backlog_budget __read_mostly = 64;
+module_param(ppe_backlog_budget, uint, 0644);
+MODULE_PARM_DESC(ppe_backlog_budget, "Max. backlog skbs per PPE run");
+
+static bool ppe_fb_stats __read_mostly = false;
+static struct jump_label_key engine_fb_stats_key;
+static DEFINE_MUTEX(engine_fb_stats_mutex);
+
+static int engine_fb_stats_set(const char *val, const struct kernel_param *kp)
+{
+	int ret;
+	bool old;
+
+	mutex_lock(&engine_fb_stats_mutex);
+	old = ppe_fb_stats;
+	ret = param_set_bool(val, kp);
+	if (!ret && ppe_fb_stats != old) {
+		if (ppe_fb_stats)
+			jump_label_inc(&engine_fb_stats_key);
+		else
+			jump_label_dec(&engine_fb_stats_key);
+	}
+	mutex_unlock(&engine_fb_stats_mutex);
+
+	return ret;
+}
+
+static struct kernel_param_ops engine_fb_stats_ops = {
+	.set = engine_fb_stats_set,
+	.get = param_get_bool,
+};
+
+module_param_cb(ppe_fb_stats, &engine_fb_stats_ops, &ppe_fb_stats, 0644);
+MODULE_PARM_DESC(ppe_fb_stats, "Per fblock packet and cycle accounting");
+
+static bool ppe_steal __read_mostly = false;
+module_param(ppe_steal, bool, 0644);
+MODULE_PARM_DESC(ppe_steal, "Let idle PPEs take flows from busy ones");
+
 static struct engine_iostats __percpu *iostats;
+static struct engine_paths __percpu *empaths;
 static struct engine_disc __percpu *emdiscs;
 extern struct proc_dir_entry *lana_proc_dir;
 static struct proc_dir_entry *engine_proc;
 
-static inline void engine_inc_pkts_stats(void)
+static inline void engine_inc_sched_stats(void)
 {
-	this_cpu_inc(iostats->pkts);
+	this_cpu_inc(iostats->sched);
 }
 
-static inline void engine_inc_fblock_stats(void)
+static inline void engine_inc_resched_stats(void)
 {
-	this_cpu_inc(iostats->fblocks);
+	this_cpu_inc(iostats->resched);
 }
 
-static inline void engine_inc_timer_stats(void)
+static inline void engine_inc_drops_stats(void)
 {
-	this_cpu_inc(iostats->timer);
+	this_cpu_inc(iostats->drops);
 }
 
-static inline void engine_inc_timer_cpu_miss_stats(void)
+static inline void engine_inc_steals_stats(void)
 {
-	this_cpu_inc(iostats->timer_cpu_miss);
+	this_cpu_inc(iostats->steals);
+}
+
+static inline void engine_inc_lost_stats(void)
+{
+	this_cpu_inc(iostats->lost);
 }
 
 static inline void engine_add_bytes_stats(unsigned long bytes)
@@ -65,29 +185,224 @@ static inline void engine_add_bytes_stats(unsigned long bytes)
 	this_cpu_add(iostats->bytes, bytes);
 }
 
+static int engine_ring_init(struct engine_ring *r, unsigned int len, int node)
+{
+	r->slot = kzalloc_node(len * sizeof(*r->slot), GFP_KERNEL, node);
+	if (!r->slot)
+		return -ENOMEM;
+	r->mask = len - 1;
+	r->head = r->tail = 0;
+	return 0;
+}
+
+static inline unsigned int engine_ring_len(struct engine_ring *r)
+{
+	return ACCESS_ONCE(r->tail) - ACCESS_ONCE(r->head);
+}
+
+static inline int engine_ring_enqueue(struct engine_ring *r,
+				      struct sk_buff *skb)
+{
+	unsigned int tail = r->tail;
+
+	if (unlikely(tail - r->head > r->mask))
+		return -ENOBUFS;
+	r->slot[tail & r->mask] = skb;
+	barrier();
+	r->tail = tail + 1;
+	return 0;
+}
+
+static inline struct sk_buff *engine_ring_dequeue(struct engine_ring *r)
+{
+	struct sk_buff *skb;
+	unsigned int head = r->head;
+
+	if (head == ACCESS_ONCE(r->tail))
+		return NULL;
+	skb = r->slot[head & r->mask];
+	barrier();
+	r->head = head + 1;
+	return skb;
+}
+
+static int engine_mpsc_init(struct engine_mpsc *q, unsigned int len, int node)
+{
+	unsigned int i;
+
+	q->cell = kzalloc_node(len * sizeof(*q->cell), GFP_KERNEL, node);
+	if (!q->cell)
+		return -ENOMEM;
+	for (i = 0; i < len; ++i)
+		atomic_set(&q->cell[i].seq, i);
+	q->mask = len - 1;
+	atomic_set(&q->tail, 0);
+	q->head = 0;
+	return 0;
+}
+
+static inline unsigned int engine_mpsc_len(struct engine_mpsc *q)
+{
+	return (unsigned int) atomic_read(&q->tail) - ACCESS_ONCE(q->head);
+}
+
+static int engine_mpsc_enqueue(struct engine_mpsc *q, struct sk_buff *skb)
+{
+	int diff;
+	unsigned int pos;
+	struct engine_mpsc_cell *cell;
+
+	pos = atomic_read(&q->tail);
+	for (;;) {
+		cell = &q->cell[pos & q->mask];
+		diff = atomic_read(&cell->seq) - (int) pos;
+		smp_rmb();
+		if (diff == 0) {
+			if (atomic_cmpxchg(&q->tail, pos, pos + 1) == pos)
+				break;
+		} else if (diff < 0) {
+			/* Consumer did not release this cell yet, full! */
+			return -ENOBUFS;
+		}
+		pos = atomic_read(&q->tail);
+	}
+
+	cell->skb = skb;
+	smp_wmb();
+	atomic_set(&cell->seq, pos + 1);
+	return 0;
+}
+
+static struct sk_buff *engine_mpsc_dequeue(struct engine_mpsc *q)
+{
+	struct sk_buff *skb;
+	struct engine_mpsc_cell *cell = &q->cell[q->head & q->mask];
+
+	if (atomic_read(&cell->seq) - (int) (q->head + 1) < 0)
+		return NULL;
+	smp_rmb();
+	skb = cell->skb;
+	smp_mb();
+	atomic_set(&cell->seq, q->head + q->mask + 1);
+	q->head++;
+	return skb;
+}
+
+static inline unsigned int engine_backlog_len(struct engine_disc *disc)
+{
+	return engine_ring_len(&disc->ppe_backlog_ring) +
+	       engine_mpsc_len(&disc->ppe_backlog_mpsc);
+}
+
+static inline void engine_update_hiwat(struct engine_disc *disc,
+				       unsigned int len)
+{
+	/* Racy for remote producers, but good enough for statistics */
+	if (unlikely(len > ACCESS_ONCE(disc->hiwat)))
+		disc->hiwat = len;
+}
+
+/*
+ * Queues skb to this CPU's backlog. If the engine is not running on this
+ * CPU, the backlog tasklet gets kicked, otherwise the running engine will
+ * pick the skb up before it leaves.
+ */
 void engine_backlog_tail(struct sk_buff *skb, enum path_type dir)
 {
+	int ret;
+	struct engine_disc *disc;
+
 	write_path_to_skb(skb, dir);
-	skb_queue_tail(&(this_cpu_ptr(emdiscs)->ppe_backlog_queue), skb);
+
+	/* Process context and softirqs must not race on the local ring */
+	local_bh_disable();
+	disc = this_cpu_ptr(emdiscs);
+	ret = engine_ring_enqueue(&disc->ppe_backlog_ring, skb);
+	if (likely(!ret)) {
+		engine_update_hiwat(disc, engine_backlog_len(disc));
+		if (!ACCESS_ONCE(disc->active))
+			tasklet_schedule(&disc->ppe_backlog_tasklet);
+	}
+	local_bh_enable();
+
+	if (unlikely(ret)) {
+		engine_inc_drops_stats();
+		kfree_skb(skb);
+	}
 }
 EXPORT_SYMBOL(engine_backlog_tail);
 
-static inline struct sk_buff *engine_backlog_test_reduce(enum path_type *dir)
+/* Called via IPI on the CPU that owns the engine discipline. */
+static void engine_backlog_kick(void *data)
 {
-	struct sk_buff *skb = NULL;
-	if ((skb = skb_dequeue(&(this_cpu_ptr(emdiscs)->ppe_backlog_queue))))
-		(*dir) = read_path_from_skb(skb);
-	return skb;
+	struct engine_disc *disc = data;
+
+	clear_bit(ENGINE_DISC_KICKED, &disc->state);
+	tasklet_schedule(&disc->ppe_backlog_tasklet);
 }
 
-static inline struct sk_buff *
-engine_backlog_queue_test_reduce(enum path_type *dir, struct sk_buff_head *list)
+/*
+ * Hands skb over to the backlog of the engine on cpu. This is the
+ * multi-producer path for cross-CPU handoff, the remote engine gets
+ * kicked via IPI unless a kick is still on its way.
+ */
+void engine_backlog_cpu_tail(struct sk_buff *skb, enum path_type dir,
+			     unsigned int cpu)
 {
-	struct sk_buff *skb = NULL;
-	if ((skb = skb_dequeue(list)))
-		(*dir) = read_path_from_skb(skb);
-	return skb;
+	struct engine_disc *disc;
+
+	if (cpu == smp_processor_id()) {
+		engine_backlog_tail(skb, dir);
+		return;
+	}
+
+	write_path_to_skb(skb, dir);
+
+	disc = per_cpu_ptr(emdiscs, cpu);
+	if (unlikely(engine_mpsc_enqueue(&disc->ppe_backlog_mpsc, skb))) {
+		engine_inc_drops_stats();
+		kfree_skb(skb);
+		return;
+	}
+	engine_update_hiwat(disc, engine_backlog_len(disc));
+
+	if (!test_and_set_bit(ENGINE_DISC_KICKED, &disc->state))
+		__smp_call_function_single(cpu, &disc->csd, 0);
+}
+EXPORT_SYMBOL(engine_backlog_cpu_tail);
+
+/*
+ * Fans skb out from fb to all bound idps in ports. The first one gets skb
+ * itself and is processed on return, all others get clones through the
+ * backlog. Clones share the packet data, so an fblock that modifies it
+ * has to unshare it first, e.g. with skb_unshare(). Returns the number of
+ * idps skb went to; if none, skb was not consumed.
+ */
+int engine_fanout(const struct fblock * const fb, struct sk_buff *skb,
+		  const idp_t *ports, unsigned int num, enum path_type dir)
+{
+	unsigned int i, sent = 0;
+	struct sk_buff *cloned_skb;
+
+	for (i = 0; i < num; ++i) {
+		if (ports[i] == IDP_UNKNOWN)
+			continue;
+		if (sent++ == 0) {
+			write_next_idp_to_skb(skb, fb->idp, ports[i]);
+			continue;
+		}
+		cloned_skb = skb_clone(skb, GFP_ATOMIC);
+		if (unlikely(!cloned_skb)) {
+			engine_inc_drops_stats();
+			continue;
+		}
+		write_next_idp_to_skb(cloned_skb, fb->idp, ports[i]);
+		engine_backlog_tail(cloned_skb, dir);
+	}
+
+	return sent;
 }
+EXPORT_SYMBOL_GPL(engine_fanout);
 
 static inline void engine_this_cpu_set_active(void)
 {
@@ -96,6 +411,8 @@ static inline void engine_this_cpu_set_active(void)
 
 static inline void engine_this_cpu_set_inactive(void)
 {
+	/* Stealing peers must see our work done before we look idle */
+	smp_mb();
 	this_cpu_write(emdiscs->active, 0);
 }
 
@@ -104,84 +421,686 @@ static inline int engine_this_cpu_is_active(void)
 	return this_cpu_read(emdiscs->active);
 }
 
-int process_packet(struct sk_buff *skb, enum path_type dir)
+static inline void engine_add_pkts_stats(unsigned long pkts)
 {
-	int ret;
-	idp_t cont;
-	struct fblock *fb;
+	this_cpu_add(iostats->pkts, pkts);
+}
 
-	BUG_ON(!rcu_read_lock_held());
-	if (engine_this_cpu_is_active()) {
-		engine_backlog_tail(skb, dir);
-		return 0;
+static inline void engine_add_fblock_stats(unsigned long hops)
+{
+	this_cpu_add(iostats->fblocks, hops);
+}
+
+static inline int engine_is_idle(struct engine_disc *disc)
+{
+	int idle = !ACCESS_ONCE(disc->active);
+
+	smp_rmb();
+	return idle && engine_backlog_len(disc) == 0;
+}
+
+/*
+ * Gives back buckets whose thief went idle again. All skbs that were
+ * forwarded to it have been processed, so per-flow order is kept when we
+ * process the bucket ourselves from now on.
+ */
+static void engine_steal_release(struct engine_disc *disc)
+{
+	int i, owner;
+
+	for (i = 0; i < ENGINE_STEAL_BUCKETS && disc->nr_stolen > 0; ++i) {
+		owner = disc->steal_owner[i];
+		if (owner < 0)
+			continue;
+		if (!engine_is_idle(per_cpu_ptr(emdiscs, owner)))
+			continue;
+		disc->steal_owner[i] = -1;
+		disc->nr_stolen--;
+		atomic_dec(&per_cpu_ptr(emdiscs, owner)->nr_thieving);
 	}
-pkt:
-	ret = PPE_ERROR;
+}
 
-	engine_this_cpu_set_active();
-	engine_inc_pkts_stats();
-	engine_add_bytes_stats(skb->len);
-
-	while ((cont = read_next_idp_from_skb(skb))) {
-		fb = __search_fblock(cont);
-		if (unlikely(!fb)) {
-			/* We free the skb since the fb doesn't exist! */
-			kfree_skb(skb);
-			ret = PPE_ERROR;
+/*
+ * Looks for an idle engine that is willing to take over flows from us.
+ * Engines that gave flows away themselves are skipped, so that stolen
+ * skbs are never forwarded a second time.
+ */
+static int engine_steal_find_thief(struct engine_disc *disc)
+{
+	int cpu;
+	struct engine_disc *peer;
+
+	for_each_online_cpu(cpu) {
+		if (cpu == disc->cpu)
+			continue;
+		peer = per_cpu_ptr(emdiscs, cpu);
+		if (ACCESS_ONCE(peer->nr_stolen) > 0)
+			continue;
+		if (engine_is_idle(peer))
+			return cpu;
+	}
+
+	return -1;
+}
+
+/*
+ * Moves up to budget skbs from this CPU's backlog onto list. With
+ * ppe_steal enabled and a backlog that exceeds one budget, whole rxhash
+ * buckets are handed over to an idle peer instead. Only buckets that have
+ * not been seen in this round can be given away, and once a bucket is
+ * owned by a peer all later skbs of it follow, so per-flow order holds.
+ * The busy engine does the handover itself, thus every ring keeps a
+ * single consumer.
+ */
+static unsigned long engine_backlog_splice(struct sk_buff_head *list,
+					   unsigned int budget)
+{
+	int thief = -1, owner;
+	unsigned int bucket, steals = 0;
+	unsigned long bytes = 0;
+	u64 seen = 0;
+	struct sk_buff *skb;
+	struct engine_disc *disc;
+
+	local_bh_disable();
+	disc = this_cpu_ptr(emdiscs);
+
+	if (unlikely(disc->nr_stolen > 0))
+		engine_steal_release(disc);
+	if (ppe_steal && engine_backlog_len(disc) > budget &&
+	    atomic_read(&disc->nr_thieving) == 0)
+		thief = engine_steal_find_thief(disc);
+
+	while (budget > 0) {
+		skb = engine_ring_dequeue(&disc->ppe_backlog_ring);
+		if (!skb)
+			skb = engine_mpsc_dequeue(&disc->ppe_backlog_mpsc);
+		if (!skb)
 			break;
+
+		if (likely(disc->nr_stolen == 0 && thief < 0))
+			goto keep;
+
+		bucket = skb->rxhash & (ENGINE_STEAL_BUCKETS - 1);
+		owner = disc->steal_owner[bucket];
+		if (owner < 0 && thief >= 0 && steals < ENGINE_STEAL_PER_RUN &&
+		    !(seen & (1ULL << bucket))) {
+			owner = disc->steal_owner[bucket] = thief;
+			disc->nr_stolen++;
+			atomic_inc(&per_cpu_ptr(emdiscs, thief)->nr_thieving);
+			steals++;
+			engine_inc_steals_stats();
+		}
+		if (owner >= 0) {
+			engine_backlog_cpu_tail(skb, read_path_from_skb(skb),
+						owner);
+			continue;
 		}
+		seen |= 1ULL << bucket;
+keep:
+		bytes += skb->len;
+		__skb_queue_tail(list, skb);
+		budget--;
+	}
+	local_bh_enable();
+
+	return bytes;
+}
 
-		ret = fb->netfb_rx(fb, skb, &dir);
+/*
+ * Hands num skbs over to fb, either at once if the fblock implements the
+ * bulk receive hook, or one by one otherwise. Packets that are still in
+ * the stack are put to the tail of next for the next hop.
+ */
+static int __engine_deliver_bulk(struct fblock *fb, struct sk_buff **skbs,
+				 unsigned int num, enum path_type dir,
+				 struct sk_buff_head *next)
+{
+	int ret = PPE_SUCCESS;
+	unsigned int i;
+	int rets[PPE_BULK_MAX];
+	enum path_type dir_skb;
+
+	if (fb->netfb_rx_bulk) {
+		fb->netfb_rx_bulk(fb, skbs, rets, num, &dir);
+		for (i = 0; i < num; ++i) {
+			ret = rets[i];
+			if (ret == PPE_DROPPED)
+				continue;
+			write_path_to_skb(skbs[i], dir);
+			write_next_hop_to_skb(skbs[i]);
+			__skb_queue_tail(next, skbs[i]);
+		}
+		return ret;
+	}
+
+	for (i = 0; i < num; ++i) {
+		dir_skb = dir;
+		ret = fb->netfb_rx(fb, skbs[i], &dir_skb);
 		/* The FB frees the skb or not depending on its binding
 		 * and we must not touch it! */
-		put_fblock(fb);
-		engine_inc_fblock_stats();
-		if (ret == PPE_DROPPED) {
-			ret = PPE_DROPPED;
-			break;
+		if (ret == PPE_DROPPED)
+			continue;
+		write_path_to_skb(skbs[i], dir_skb);
+		write_next_hop_to_skb(skbs[i]);
+		__skb_queue_tail(next, skbs[i]);
+	}
+
+	return ret;
+}
+
+/*
+ * Same as above, but accounts packets, bytes, drops and cycles spent in
+ * the receive hooks to the fblock. Skbs that do not show up on next did
+ * not leave fb, they count as drops.
+ */
+static noinline int engine_deliver_bulk_stats(struct fblock *fb,
+					      struct sk_buff **skbs,
+					      unsigned int num,
+					      enum path_type dir,
+					      struct sk_buff_head *next)
+{
+	int ret;
+	unsigned int i, queued = skb_queue_len(next);
+	unsigned long bytes = 0;
+	cycles_t start, cycles;
+	struct fblock_stats *stats;
+
+	for (i = 0; i < num; ++i)
+		bytes += skbs[i]->len;
+
+	start = get_cycles();
+	ret = __engine_deliver_bulk(fb, skbs, num, dir, next);
+	cycles = get_cycles() - start;
+
+	/* Out of memory only costs us the accounting */
+	stats = fblock_lazy_this_cpu(fb->stats, sizeof(*stats));
+	if (unlikely(!stats))
+		return ret;
+
+	queued = skb_queue_len(next) - queued;
+	stats->cycles += cycles;
+	stats->pkts += num;
+	stats->bytes += bytes;
+	stats->drops += num - queued;
+
+	return ret;
+}
+
+static inline int engine_deliver_bulk(struct fblock *fb, struct sk_buff **skbs,
+				      unsigned int num, enum path_type dir,
+				      struct sk_buff_head *next)
+{
+	if (static_branch(&engine_fb_stats_key))
+		return engine_deliver_bulk_stats(fb, skbs, num, dir, next);
+	return __engine_deliver_bulk(fb, skbs, num, dir, next);
+}
+
+/*
+ * Translates the next idp of skb into its fblock. Stable chains are
+ * served from this CPU's compiled path of the skb's ingress point without
+ * lookup. Misses fall back to the fblock map and recompile the hop. No
+ * reference is taken, the engine relies on RCU to keep fblocks alive.
+ */
+static struct fblock *engine_path_lookup(struct sk_buff *skb, idp_t cont)
+{
+	unsigned int gen, hop = SKB_LANA_INF(skb)->hop;
+	idp_t src = SKB_LANA_INF(skb)->idp_in;
+	struct engine_path *path;
+	struct fblock *fb;
+
+	path = &this_cpu_ptr(empaths)->path[hash_32(src, ENGINE_PATHS_BITS)];
+	gen = fblock_topology_read();
+
+	if (likely(path->src == src && path->gen == gen && hop < path->len &&
+		   path->hop[hop].idp == cont)) {
+		this_cpu_inc(iostats->hits);
+		return path->hop[hop].fb;
+	}
+
+	fb = __search_fblock_rcu(cont);
+	if (unlikely(!fb) || hop >= ENGINE_PATH_HOPS)
+		return fb;
+
+	if (path->src != src || path->gen != gen) {
+		path->src = src;
+		path->gen = gen;
+		path->len = 0;
+	}
+	if (hop <= path->len) {
+		path->hop[hop].idp = cont;
+		path->hop[hop].fb = fb;
+		if (hop == path->len)
+			path->len++;
+	}
+
+	return fb;
+}
+
+/*
+ * Walks all packets of list through the graph, hop by hop. Consecutive
+ * packets heading to the same functional block with the same path type
+ * share a single lookup and are delivered as one vector. The path
+ * direction of each packet is kept within its control buffer.
+ */
+static int engine_process_hops(struct sk_buff_head *list)
+{
+	int ret = PPE_SUCCESS;
+	unsigned int num = 0;
+	unsigned long hops = 0;
+	idp_t cont, last = IDP_UNKNOWN;
+	enum path_type dir, vdir = TYPE_INGRESS;
+	struct fblock *fb = NULL;
+	struct sk_buff *skb, *vec[PPE_BULK_MAX];
+	struct sk_buff_head next;
+
+	__skb_queue_head_init(&next);
+
+	while (!skb_queue_empty(list)) {
+		while ((skb = __skb_dequeue(list))) {
+			cont = read_next_idp_from_skb(skb);
+			if (unlikely(cont == IDP_UNKNOWN))
+				continue;
+			dir = read_path_from_skb(skb);
+			if (num > 0 && (cont != last || dir != vdir ||
+					num == PPE_BULK_MAX)) {
+				ret = engine_deliver_bulk(fb, vec, num, vdir,
+							  &next);
+				hops += num;
+				num = 0;
+			}
+			if (cont != last) {
+				fb = engine_path_lookup(skb, cont);
+				last = cont;
+			}
+			if (unlikely(!fb)) {
+				/* We free the skb since the fb doesn't exist! */
+				kfree_skb(skb);
+				engine_inc_lost_stats();
+				ret = PPE_ERROR;
+				continue;
+			}
+
+			vdir = dir;
+			vec[num++] = skb;
 		}
+
+		if (num > 0) {
+			ret = engine_deliver_bulk(fb, vec, num, vdir, &next);
+			hops += num;
+			num = 0;
+		}
+
+		skb_queue_splice_init(&next, list);
 	}
 
-	if ((skb = engine_backlog_test_reduce(&dir)))
-		goto pkt;
+	engine_add_fblock_stats(hops);
+
+	return ret;
+}
+
+/*
+ * Runs the engine on list plus at most one budget of backlog skbs. If
+ * backlog work is left over, the tasklet continues later on, so that we
+ * do not starve the rest of the softirq work. Must be called with the
+ * engine marked active.
+ */
+static int engine_run(struct sk_buff_head *list, unsigned long bytes)
+{
+	int ret = PPE_SUCCESS;
+	unsigned int budget = ppe_backlog_budget;
+	struct engine_disc *disc = this_cpu_ptr(emdiscs);
+
+	while (!skb_queue_empty(list)) {
+		engine_add_pkts_stats(skb_queue_len(list));
+		engine_add_bytes_stats(bytes);
+
+		ret = engine_process_hops(list);
+
+		bytes = engine_backlog_splice(list, budget);
+		budget -= min_t(unsigned int, budget, skb_queue_len(list));
+	}
 
 	engine_this_cpu_set_inactive();
+	if (engine_backlog_len(disc) > 0) {
+		engine_inc_resched_stats();
+		tasklet_schedule(&disc->ppe_backlog_tasklet);
+	}
+
 	return ret;
 }
-EXPORT_SYMBOL_GPL(process_packet);
 
-static enum hrtimer_restart engine_timer_handler(struct hrtimer *self)
+void engine_steer_init(struct engine_steer *steer)
 {
-	/* Note: we could end up on a different CPU */
-	enum path_type dir;
-	struct sk_buff *skb;
-	struct tasklet_hrtimer *thr = container_of(self, struct tasklet_hrtimer, timer);
-	struct engine_disc *disc = container_of(thr, struct engine_disc, htimer);
+	RCU_INIT_POINTER(steer->map, NULL);
+	steer->hash = STEER_HASH_RXHASH;
+}
+EXPORT_SYMBOL_GPL(engine_steer_init);
 
-	if (likely(ACCESS_ONCE(disc->active)))
-		goto out;
-	if (skb_queue_empty(&disc->ppe_backlog_queue))
+void engine_steer_destroy(struct engine_steer *steer)
+{
+	struct engine_steer_map *map;
+
+	map = xchg((__force struct engine_steer_map **) &steer->map, NULL);
+	if (map)
+		kfree_rcu(map, rcu);
+}
+EXPORT_SYMBOL_GPL(engine_steer_destroy);
+
+static int engine_steer_set_cpus(struct engine_steer *steer, const char *val)
+{
+	int ret;
+	unsigned int cpu;
+	cpumask_var_t mask;
+	struct engine_steer_map *map = NULL, *old;
+
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+	ret = cpulist_parse(val, mask);
+	if (ret)
 		goto out;
-	if (disc->cpu != smp_processor_id()) {
-		engine_inc_timer_cpu_miss_stats();
-		if (skb_queue_len(&disc->ppe_backlog_queue) <= 150)
+
+	get_online_cpus();
+	cpumask_and(mask, mask, cpu_online_mask);
+	if (!cpumask_empty(mask)) {
+		map = kzalloc(sizeof(*map) + cpumask_weight(mask) *
+			      sizeof(map->cpu[0]), GFP_KERNEL);
+		if (!map) {
+			put_online_cpus();
+			ret = -ENOMEM;
 			goto out;
+		}
+		for_each_cpu(cpu, mask)
+			map->cpu[map->num++] = cpu;
 	}
+	put_online_cpus();
 
-	rcu_read_lock();
+	/* An empty list switches steering off again */
+	old = xchg((__force struct engine_steer_map **) &steer->map, map);
+	if (old)
+		kfree_rcu(old, rcu);
+out:
+	free_cpumask_var(mask);
+	return ret;
+}
+
+/*
+ * Handles the steering options of an ingress point, i.e.
+ * rps_cpus=<cpulist> and rps_hash=rxhash|mac. Returns -ENOENT for keys
+ * that are not ours.
+ */
+int engine_steer_set_option(struct engine_steer *steer, const char *key,
+			    const char *val)
+{
+	if (!strcmp(key, "rps_cpus"))
+		return engine_steer_set_cpus(steer, val);
+	if (!strcmp(key, "rps_hash")) {
+		if (!strcmp(val, "rxhash"))
+			steer->hash = STEER_HASH_RXHASH;
+		else if (!strcmp(val, "mac"))
+			steer->hash = STEER_HASH_MAC;
+		else
+			return -EINVAL;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+EXPORT_SYMBOL_GPL(engine_steer_set_option);
+
+static inline u32 engine_steer_hash(struct engine_steer *steer,
+				    struct sk_buff *skb)
+{
+	if (ACCESS_ONCE(steer->hash) == STEER_HASH_MAC) {
+		/* Addresses and type of the link layer header */
+		skb->rxhash = jhash(skb_mac_header(skb), 2 * ETH_ALEN + 2, 0);
+		if (unlikely(!skb->rxhash))
+			skb->rxhash = 1;
+		return skb->rxhash;
+	}
+
+	return skb_get_rxhash(skb);
+}
+
+/*
+ * Ingress entry for rx handlers. Hands skb over to the engine of the CPU
+ * that its flow hashes to, so that all skbs of one flow are processed in
+ * order on the same CPU. Without a steering map, skb gets processed on
+ * the current CPU. Must be called under rcu_read_lock.
+ */
+int engine_steer_packet(struct engine_steer *steer, struct sk_buff *skb,
+			enum path_type dir)
+{
+	u32 hash;
+	unsigned int cpu;
+	struct engine_steer_map *map;
+
+	map = rcu_dereference(steer->map);
+	if (likely(!map))
+		return process_packet(skb, dir);
+
+	hash = engine_steer_hash(steer, skb);
+	cpu = map->cpu[((u64) hash * map->num) >> 32];
+	if (unlikely(!cpu_online(cpu)) || cpu == smp_processor_id())
+		return process_packet(skb, dir);
+
+	write_path_start_to_skb(skb);
+	engine_backlog_cpu_tail(skb, dir, cpu);
+	return PPE_SUCCESS;
+}
+EXPORT_SYMBOL_GPL(engine_steer_packet);
+
+/*
+ * Handles the egress option of a device block, i.e. xmit=queue|direct.
+ * In direct mode skbs never take the qdisc way, not even under load, so
+ * that a flow cannot overtake itself; what the driver does not take is
+ * dropped, see __engine_direct_xmit(). Returns -ENOENT for keys that are
+ * not ours.
+ */
+int engine_xmit_set_option(int *mode, const char *key, const char *val)
+{
+	if (strcmp(key, "xmit"))
+		return -ENOENT;
+	if (!strcmp(val, "queue"))
+		ACCESS_ONCE(*mode) = XMIT_QUEUE;
+	else if (!strcmp(val, "direct"))
+		ACCESS_ONCE(*mode) = XMIT_DIRECT;
+	else
+		return -EINVAL;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(engine_xmit_set_option);
+
+static int engine_direct_xmit_one(struct sk_buff *skb, u32 features,
+				  struct netdev_queue *txq)
+{
+	int ret;
+	struct net_device *dev = skb->dev;
+
+	if (((skb_has_frag_list(skb) && !(features & NETIF_F_FRAGLIST)) ||
+	     (skb_shinfo(skb)->nr_frags && !(features & NETIF_F_SG))) &&
+	    __skb_linearize(skb))
+		goto drop;
+	if (skb->ip_summed == CHECKSUM_PARTIAL &&
+	    !(features & NETIF_F_ALL_CSUM) && skb_checksum_help(skb))
+		goto drop;
+
+	__netif_tx_lock_bh(txq);
+	if (unlikely(netif_tx_queue_frozen_or_stopped(txq))) {
+		__netif_tx_unlock_bh(txq);
+		goto drop;
+	}
+	ret = dev->netdev_ops->ndo_start_xmit(skb, dev);
+	if (likely(dev_xmit_complete(ret)))
+		txq_trans_update(txq);
+	__netif_tx_unlock_bh(txq);
+
+	if (unlikely(!dev_xmit_complete(ret)))
+		goto drop;
+	return ret;
+drop:
+	kfree_skb(skb);
+	return NET_XMIT_DROP;
+}
+
+/*
+ * Hands skb straight to the driver on the given TX queue, bypassing the
+ * qdisc layer and the taps, since LANA already did its own processing.
+ * What the device cannot offload for skb's protocol, i.e. GSO,
+ * linearization and checksumming, is done here in software. Like with
+ * AF_PACKET's qdisc bypass, a stopped queue or NETDEV_TX_BUSY drops skb
+ * instead of queueing it, since later skbs of the same flow would go out
+ * ahead of it otherwise. Consumes skb.
+ */
+int __engine_direct_xmit(struct sk_buff *skb, u16 queue)
+{
+	int ret = NET_XMIT_SUCCESS, err;
+	u32 features;
+	struct net_device *dev = skb->dev;
+	struct netdev_queue *txq;
+	struct sk_buff *segs, *next;
+
+	if (unlikely(!netif_running(dev) || !netif_carrier_ok(dev))) {
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
+	}
+
+	if (unlikely(queue >= dev->real_num_tx_queues))
+		queue %= dev->real_num_tx_queues;
+	skb_set_queue_mapping(skb, queue);
+	txq = netdev_get_tx_queue(dev, queue);
+
+	features = netif_skb_features(skb);
+	if (likely(!netif_needs_gso(skb, features)))
+		return engine_direct_xmit_one(skb, features, txq);
 
-	skb = engine_backlog_queue_test_reduce(&dir, &disc->ppe_backlog_queue);
-	BUG_ON(!skb);
-	process_packet(skb, dir);
+	segs = skb_gso_segment(skb, features);
+	if (IS_ERR(segs)) {
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
+	}
+	if (!segs)
+		return engine_direct_xmit_one(skb, features, txq);
+	consume_skb(skb);
+
+	for (; segs; segs = next) {
+		next = segs->next;
+		segs->next = NULL;
+		err = engine_direct_xmit_one(segs, features, txq);
+		if (err != NET_XMIT_SUCCESS)
+			ret = err;
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(__engine_direct_xmit);
+
+/* As above, on the TX queue of the current CPU */
+int engine_direct_xmit(struct sk_buff *skb)
+{
+	return __engine_direct_xmit(skb, raw_smp_processor_id() %
+					 skb->dev->real_num_tx_queues);
+}
+EXPORT_SYMBOL_GPL(engine_direct_xmit);
+
+/*
+ * Bulk entry point into the packet processing engine. All packets are
+ * taken off the list. The per-CPU active flag, the engine statistics and
+ * the fblock lookups are amortized over the whole batch.
+ */
+int process_packet_list(struct sk_buff_head *list, enum path_type dir)
+{
+	int ret = PPE_SUCCESS;
+	unsigned long bytes = 0;
+	struct sk_buff *skb;
 
+	BUG_ON(!rcu_read_lock_held());
+	if (unlikely(skb_queue_empty(list)))
+		return ret;
+
+	skb_queue_walk(list, skb) {
+		write_path_to_skb(skb, dir);
+		write_path_start_to_skb(skb);
+		bytes += skb->len;
+	}
+
+	if (engine_this_cpu_is_active()) {
+		while ((skb = __skb_dequeue(list)))
+			engine_backlog_tail(skb, dir);
+		return ret;
+	}
+
+	engine_this_cpu_set_active();
+	return engine_run(list, bytes);
+}
+EXPORT_SYMBOL_GPL(process_packet_list);
+
+int process_packet_array(struct sk_buff **skbs, unsigned int num,
+			 enum path_type dir)
+{
+	unsigned int i;
+	struct sk_buff_head list;
+
+	__skb_queue_head_init(&list);
+	for (i = 0; i < num; ++i)
+		__skb_queue_tail(&list, skbs[i]);
+
+	return process_packet_list(&list, dir);
+}
+EXPORT_SYMBOL_GPL(process_packet_array);
+
+int process_packet(struct sk_buff *skb, enum path_type dir)
+{
+	struct sk_buff_head list;
+
+	__skb_queue_head_init(&list);
+	__skb_queue_tail(&list, skb);
+
+	return process_packet_list(&list, dir);
+}
+EXPORT_SYMBOL_GPL(process_packet);
+
+static void engine_backlog_tasklet(unsigned long data)
+{
+	unsigned long bytes;
+	struct sk_buff_head list;
+
+	engine_inc_sched_stats();
+	/*
+	 * The engine got interrupted while running in process context, it
+	 * drains the backlog itself before it leaves.
+	 */
+	if (unlikely(engine_this_cpu_is_active()))
+		return;
+
+	/*
+	 * Become active before the backlog is spliced, otherwise stealing
+	 * peers could see us idle with skbs in flight.
+	 */
+	engine_this_cpu_set_active();
+	__skb_queue_head_init(&list);
+	bytes = engine_backlog_splice(&list, ppe_backlog_budget);
+	if (skb_queue_empty(&list)) {
+		engine_this_cpu_set_inactive();
+		return;
+	}
+
+	rcu_read_lock();
+	engine_run(&list, bytes);
 	rcu_read_unlock();
-out:
-	engine_inc_timer_stats();
-	tasklet_hrtimer_start(thr, ktime_set(0, 100000000),
-			      HRTIMER_MODE_REL);
-	return HRTIMER_NORESTART;
 }
 
+void engine_cpu_stats(unsigned int cpu, struct engine_iostats *stats,
+		      unsigned int *backlog, unsigned int *hiwat)
+{
+	struct engine_disc *emdisc_cpu = per_cpu_ptr(emdiscs, cpu);
+
+	memcpy(stats, per_cpu_ptr(iostats, cpu), sizeof(*stats));
+	*backlog = engine_backlog_len(emdisc_cpu);
+	*hiwat = emdisc_cpu->hiwat;
+}
+EXPORT_SYMBOL_GPL(engine_cpu_stats);
+
 static int engine_procfs(char *page, char **start, off_t offset,
 			 int count, int *eof, void *data)
 {
@@ -194,11 +1113,14 @@ static int engine_procfs(char *page, char **start, off_t offset,
 		struct engine_disc *emdisc_cpu;
 		iostats_cpu = per_cpu_ptr(iostats, cpu);
 		emdisc_cpu = per_cpu_ptr(emdiscs, cpu);
-		len += sprintf(page + len, "CPU%u:\t%llu\t%llu\t%llu\t%llu\t%llu\t%u\n",
+		len += sprintf(page + len, "CPU%u:\t%llu\t%llu\t%llu\t%llu\t%llu\t"
+			       "%llu\t%llu\t%llu\t%u\t%u\t%llu\n",
 			       cpu, iostats_cpu->pkts, iostats_cpu->bytes,
-			       iostats_cpu->fblocks, iostats_cpu->timer,
-			       iostats_cpu->timer_cpu_miss,
-			       skb_queue_len(&emdisc_cpu->ppe_backlog_queue));
+			       iostats_cpu->fblocks, iostats_cpu->sched,
+			       iostats_cpu->resched, iostats_cpu->drops,
+			       iostats_cpu->steals, iostats_cpu->hits,
+			       engine_backlog_len(emdisc_cpu),
+			       emdisc_cpu->hiwat, iostats_cpu->lost);
 	}
 	put_online_cpus();
 
@@ -210,6 +1132,10 @@ static int engine_procfs(char *page, char **start, off_t offset,
 int init_engine(void)
 {
 	unsigned int cpu;
+
+	BUILD_BUG_ON(sizeof(struct sock_lana_inf) >
+		     sizeof(((struct sk_buff *) 0)->cb));
+
 	iostats = alloc_percpu(struct engine_iostats);
 	if (!iostats)
 		return -ENOMEM;
@@ -220,38 +1146,74 @@ int init_engine(void)
 		iostats_cpu->bytes = 0;
 		iostats_cpu->pkts = 0;
 		iostats_cpu->fblocks = 0;
-		iostats_cpu->timer = 0;
-		iostats_cpu->timer_cpu_miss = 0;
+		iostats_cpu->sched = 0;
+		iostats_cpu->resched = 0;
+		iostats_cpu->drops = 0;
+		iostats_cpu->steals = 0;
+		iostats_cpu->hits = 0;
+		iostats_cpu->lost = 0;
 	}
 	put_online_cpus();
 
+	/* Zeroed paths are empty and never match */
+	empaths = alloc_percpu(struct engine_paths);
+	if (!empaths)
+		goto err;
+
+	if (ppe_backlog_len < 2)
+		ppe_backlog_len = 2;
+	ppe_backlog_len = roundup_pow_of_two(ppe_backlog_len);
+
 	emdiscs = alloc_percpu(struct engine_disc);
 	if (!emdiscs)
-		goto err;
+		goto err3;
 	get_online_cpus();
 	for_each_online_cpu(cpu) {
 		struct engine_disc *emdisc_cpu;
 		emdisc_cpu = per_cpu_ptr(emdiscs, cpu);
 		emdisc_cpu->active = 0;
 		emdisc_cpu->cpu = cpu;
-		skb_queue_head_init(&emdisc_cpu->ppe_backlog_queue);
-		tasklet_hrtimer_init(&emdisc_cpu->htimer,
-				     engine_timer_handler,
-				     CLOCK_REALTIME, HRTIMER_MODE_ABS);
-		tasklet_hrtimer_start(&emdisc_cpu->htimer,
-				      ktime_set(0, 100000000),
-				      HRTIMER_MODE_REL);
+		emdisc_cpu->state = 0;
+		emdisc_cpu->hiwat = 0;
+		emdisc_cpu->nr_stolen = 0;
+		atomic_set(&emdisc_cpu->nr_thieving, 0);
+		memset(emdisc_cpu->steal_owner, -1,
+		       sizeof(emdisc_cpu->steal_owner));
+		if (engine_ring_init(&emdisc_cpu->ppe_backlog_ring,
+				     ppe_backlog_len, cpu_to_node(cpu)))
+			goto err1;
+		if (engine_mpsc_init(&emdisc_cpu->ppe_backlog_mpsc,
+				     ppe_backlog_len, cpu_to_node(cpu)))
+			goto err1;
+		emdisc_cpu->csd.func = engine_backlog_kick;
+		emdisc_cpu->csd.info = emdisc_cpu;
+		emdisc_cpu->csd.flags = 0;
+		tasklet_init(&emdisc_cpu->ppe_backlog_tasklet,
+			     engine_backlog_tasklet,
+			     (unsigned long) emdisc_cpu);
 	}
 	put_online_cpus();
 
 	engine_proc = create_proc_read_entry("ppe", 0400, lana_proc_dir,
 					     engine_procfs, NULL);
 	if (!engine_proc)
-		goto err1;
+		goto err2;
 
 	return 0;
 err1:
+	put_online_cpus();
+err2:
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		struct engine_disc *emdisc_cpu;
+		emdisc_cpu = per_cpu_ptr(emdiscs, cpu);
+		kfree(emdisc_cpu->ppe_backlog_ring.slot);
+		kfree(emdisc_cpu->ppe_backlog_mpsc.cell);
+	}
+	put_online_cpus();
 	free_percpu(emdiscs);
+err3:
+	free_percpu(empaths);
 err:
 	free_percpu(iostats);
 	return -ENOMEM;
@@ -261,19 +1223,27 @@ EXPORT_SYMBOL_GPL(init_engine);
 void cleanup_engine(void)
 {
 	unsigned int cpu;
-	if (iostats)
-		free_percpu(iostats);
 	if (emdiscs) {
 		get_online_cpus();
 		for_each_online_cpu(cpu) {
+			struct sk_buff *skb;
 			struct engine_disc *emdisc_cpu;
 			emdisc_cpu = per_cpu_ptr(emdiscs, cpu);
-			tasklet_hrtimer_cancel(&emdisc_cpu->htimer);
-			skb_queue_purge(&emdisc_cpu->ppe_backlog_queue);
+			tasklet_kill(&emdisc_cpu->ppe_backlog_tasklet);
+			while ((skb = engine_ring_dequeue(&emdisc_cpu->ppe_backlog_ring)))
+				kfree_skb(skb);
+			while ((skb = engine_mpsc_dequeue(&emdisc_cpu->ppe_backlog_mpsc)))
+				kfree_skb(skb);
+			kfree(emdisc_cpu->ppe_backlog_ring.slot);
+			kfree(emdisc_cpu->ppe_backlog_mpsc.cell);
 		}
 		put_online_cpus();
 		free_percpu(emdiscs);
 	}
+	if (empaths)
+		free_percpu(empaths);
+	if (iostats)
+		free_percpu(iostats);
 	remove_proc_entry("ppe", lana_proc_dir);
 }
 EXPORT_SYMBOL_GPL(cleanup_engine);
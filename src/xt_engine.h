@@ -10,6 +10,8 @@
 #define XT_ENGINE_H
 
 #include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/rcupdate.h>
 #include "xt_fblock.h"
 
 #define PPE_SUCCESS		0
@@ -17,8 +19,79 @@
 #define PPE_HALT		PPE_DROPPED
 #define PPE_ERROR		2
 
+/* Max. number of skbs handed over to a netfb_rx_bulk() call */
+#define PPE_BULK_MAX		32
+
+/* Flow hash used by the ingress steering stage */
+#define STEER_HASH_RXHASH	0
+#define STEER_HASH_MAC		1
+
+/* Egress mode of the device blocks, set by xmit=queue|direct */
+#define XMIT_QUEUE		0
+#define XMIT_DIRECT		1
+
+struct engine_steer_map {
+	struct rcu_head rcu;
+	unsigned int num;
+	u16 cpu[0];
+};
+
+/*
+ * Per device steering state of ingress points: flows get spread across
+ * the engines of the configured CPUs, no map means no steering.
+ */
+struct engine_steer {
+	struct engine_steer_map __rcu *map;
+	int hash;
+};
+
+struct engine_iostats {
+	unsigned long long bytes;
+	unsigned long long pkts;
+	unsigned long long fblocks;
+	unsigned long long sched;
+	unsigned long long resched;
+	unsigned long long drops;
+	unsigned long long steals;
+	unsigned long long hits;
+	/* Packets whose next idp had no fblock, e.g. a replace gone wrong */
+	unsigned long long lost;
+} ____cacheline_aligned;
+
 extern int process_packet(struct sk_buff *skb, enum path_type dir);
+extern int process_packet_list(struct sk_buff_head *list, enum path_type dir);
+extern int process_packet_array(struct sk_buff **skbs, unsigned int num,
+				enum path_type dir);
 extern void engine_backlog_tail(struct sk_buff *skb, enum path_type dir);
+extern void engine_backlog_cpu_tail(struct sk_buff *skb, enum path_type dir,
+				    unsigned int cpu);
+extern int engine_fanout(const struct fblock * const fb, struct sk_buff *skb,
+			 const idp_t *ports, unsigned int num,
+			 enum path_type dir);
+
+extern void engine_steer_init(struct engine_steer *steer);
+extern void engine_steer_destroy(struct engine_steer *steer);
+extern int engine_steer_set_option(struct engine_steer *steer,
+				   const char *key, const char *val);
+extern int engine_steer_packet(struct engine_steer *steer,
+			       struct sk_buff *skb, enum path_type dir);
+
+extern int engine_xmit_set_option(int *mode, const char *key,
+				  const char *val);
+extern int __engine_direct_xmit(struct sk_buff *skb, u16 queue);
+extern int engine_direct_xmit(struct sk_buff *skb);
+
+/* Egress exit of the device blocks, skb->dev must be set. Consumes skb. */
+static inline int engine_xmit(struct sk_buff *skb, int mode)
+{
+	if (mode == XMIT_DIRECT)
+		return engine_direct_xmit(skb);
+	return dev_queue_xmit(skb);
+}
+
+/* Unlocked snapshot of a possible CPU's counters and backlog */
+extern void engine_cpu_stats(unsigned int cpu, struct engine_iostats *stats,
+			     unsigned int *backlog, unsigned int *hiwat);
 
 extern int init_engine(void);
 extern void cleanup_engine(void);
@@ -18,11 +18,23 @@
 #include <linux/rwlock.h>
 #include <linux/slab.h>
 #include <linux/proc_fs.h>
-#include <linux/radix-tree.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/bitmap.h>
+#include <linux/workqueue.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/kref.h>
 
 #include "xt_fblock.h"
 #include "xt_idp.h"
 #include "xt_critbit.h"
+#include "xt_latency.h"
 
 struct idp_elem {
 	char name[FBNAMSIZ];
@@ -32,15 +44,46 @@ struct idp_elem {
 
 static struct critbit_tree idpmap;
 
-RADIX_TREE(fblmap, GFP_ATOMIC);
+#define FBLTAB_MIN_SIZE	64
 
-static atomic64_t idp_counter;
+struct fblock_table __rcu *fbltab;
+EXPORT_SYMBOL_GPL(fbltab);
+
+/* Serializes all writers of fbltab */
+static DEFINE_MUTEX(fbltab_lock);
+
+/*
+ * Allocated idps, always as large as fbltab. Released idps stay set until
+ * a grace period has passed, so that no reader can still hold them when
+ * they are handed out again. Bits are only set under fbltab_lock, but
+ * cleared from RCU callbacks, hence the extra lock.
+ */
+static unsigned long *idp_map;
+static DEFINE_SPINLOCK(idp_map_lock);
+
+struct idp_release {
+	idp_t idp;
+	struct rcu_head rcu;
+};
+
+static void fblock_table_shrink_work(struct work_struct *work);
+static DECLARE_WORK(fbltab_shrink, fblock_table_shrink_work);
+
+atomic_t fblock_topology_gen = ATOMIC_INIT(0);
+EXPORT_SYMBOL_GPL(fblock_topology_gen);
+
+static inline void fblock_topology_changed(void)
+{
+	smp_mb__before_atomic_inc();
+	atomic_inc(&fblock_topology_gen);
+}
 
 static struct kmem_cache *fblock_cache = NULL;
 
 extern struct proc_dir_entry *lana_proc_dir;
 
 static struct proc_dir_entry *fblocks_proc;
+static struct proc_dir_entry *fbstats_proc;
 
 const char *path_names[] = {
         "ingress",
@@ -48,11 +91,6 @@ const char *path_names[] = {
 };
 EXPORT_SYMBOL(path_names);
 
-static inline idp_t provide_new_fblock_idp(void)
-{
-	return (idp_t) atomic64_inc_return(&idp_counter);
-}
-
 static int register_to_fblock_namespace(char *name, idp_t val)
 {
 	struct idp_elem *elem;
@@ -201,16 +239,190 @@ int fblock_set_option(struct fblock *fb, char *opt_string)
 }
 EXPORT_SYMBOL_GPL(fblock_set_option);
 
-/* Must already hold spin_lock */
-static void fblock_update_selfref(struct fblock_notifier *head,
-				  struct fblock *self)
+/*
+ * New port table of num ports, copied from old if given. Needs no lock;
+ * atomic since fblock_ports_replace() calls it under fblock_ports_lock.
+ */
+static struct fblock_ports *fblock_ports_alloc(unsigned int num,
+					      struct fblock_ports *old)
+{
+	unsigned int i;
+	struct fblock_ports *ports;
+
+	ports = kmalloc(sizeof(*ports) + num * sizeof(ports->port[0]),
+			GFP_ATOMIC);
+	if (!ports)
+		return NULL;
+	ports->num = num;
+	for (i = 0; i < num; ++i)
+		ports->port[i] = old ? old->port[i] : IDP_UNKNOWN;
+
+	return ports;
+}
+
+/* Serializes all port replacements, it's control path only. */
+static DEFINE_SPINLOCK(fblock_ports_lock);
+
+static int fblock_ports_replace(struct fblock *fb, unsigned int port,
+				idp_t expect, idp_t idp)
+{
+	int ret = 0;
+	struct fblock_ports *old, *new;
+
+	spin_lock_bh(&fblock_ports_lock);
+	old = rcu_dereference_protected(fb->ports,
+					lockdep_is_held(&fblock_ports_lock));
+	if (unlikely(port >= old->num)) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (old->port[port] != expect) {
+		ret = expect == IDP_UNKNOWN ? -EBUSY : -ENOENT;
+		goto out;
+	}
+	new = fblock_ports_alloc(old->num, old);
+	if (!new) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	new->port[port] = idp;
+	rcu_assign_pointer(fb->ports, new);
+	kfree_rcu(old, rcu);
+out:
+	spin_unlock_bh(&fblock_ports_lock);
+	return ret;
+}
+
+int fblock_bind_port(struct fblock *fb, unsigned int port, idp_t idp)
 {
-	while (rcu_dereference_raw(head) != NULL) {
-		rcu_assign_pointer(head->self, self);
-		rcu_assign_pointer(head, head->next);
+	return fblock_ports_replace(fb, port, IDP_UNKNOWN, idp);
+}
+EXPORT_SYMBOL_GPL(fblock_bind_port);
+
+int fblock_unbind_port(struct fblock *fb, unsigned int port, idp_t idp)
+{
+	return fblock_ports_replace(fb, port, idp, IDP_UNKNOWN);
+}
+EXPORT_SYMBOL_GPL(fblock_unbind_port);
+
+#define FBLOCK_SUBS_BITS	10
+#define FBLOCK_SUB_QUEUED	0
+
+/* All subscriptions by (owner, remote), lists below are under the lock */
+static struct hlist_head fblock_subs[1 << FBLOCK_SUBS_BITS];
+static DEFINE_SPINLOCK(fblock_subs_lock);
+
+struct fblock_event_queue {
+	spinlock_t lock;
+	struct list_head list;
+	struct work_struct work;
+};
+
+static DEFINE_PER_CPU(struct fblock_event_queue, fblock_events);
+
+static inline struct hlist_head *fblock_subs_bucket(struct fblock_subscrib *owner,
+						    idp_t remote)
+{
+	return &fblock_subs[hash_long((unsigned long) owner ^ remote,
+				      FBLOCK_SUBS_BITS)];
+}
+
+static struct fblock_subscrib *fblock_subscrib_alloc(void)
+{
+	struct fblock_subscrib *sub = kzalloc(sizeof(*sub), GFP_ATOMIC);
+	if (!sub)
+		return NULL;
+	INIT_LIST_HEAD(&sub->subscribers);
+	INIT_LIST_HEAD(&sub->subscriptions);
+	INIT_LIST_HEAD(&sub->queue);
+	kref_init(&sub->ref);
+	sub->idp = IDP_UNKNOWN;
+	return sub;
+}
+
+static void fblock_subscrib_release(struct kref *ref)
+{
+	struct fblock_subscrib *sub = container_of(ref, struct fblock_subscrib,
+						   ref);
+	kfree_rcu(sub, rcu);
+}
+
+static inline void fblock_subscrib_put(struct fblock_subscrib *sub)
+{
+	if (sub)
+		kref_put(&sub->ref, fblock_subscrib_release);
+}
+
+static void fblock_events_drain(struct work_struct *work)
+{
+	LIST_HEAD(list);
+	unsigned long cmd, pending;
+	struct fblock_notifier *fn;
+	struct fblock_subscrib *sub, *tmp;
+	struct fblock_event_queue *q = container_of(work,
+						    struct fblock_event_queue,
+						    work);
+
+	spin_lock_bh(&q->lock);
+	list_splice_init(&q->list, &list);
+	spin_unlock_bh(&q->lock);
+
+	list_for_each_entry_safe(sub, tmp, &list, queue) {
+		list_del_init(&sub->queue);
+		/* From here on, new events queue sub again */
+		clear_bit(FBLOCK_SUB_QUEUED, &sub->state);
+		smp_mb__after_clear_bit();
+		pending = xchg(&sub->pending, 0);
+
+		rcu_read_lock();
+		for_each_set_bit(cmd, &pending, BITS_PER_LONG) {
+			list_for_each_entry_rcu(fn, &sub->subscribers, sub_list)
+				fn->nb.notifier_call(&fn->nb, cmd, &sub->idp);
+		}
+		rcu_read_unlock();
+
+		fblock_subscrib_put(sub);
 	}
 }
 
+int notify_fblock_subscribers(struct fblock *us, unsigned long cmd)
+{
+	struct fblock_subscrib *sub;
+	struct fblock_event_queue *q;
+
+	BUG_ON(cmd >= BITS_PER_LONG);
+	sub = rcu_dereference_raw(us->others);
+	if (unlikely(!sub))
+		return -ENOENT;
+
+	sub->idp = us->idp;
+	/* Coalesced with the one not yet delivered */
+	if (test_and_set_bit(cmd, &sub->pending))
+		return 0;
+	if (test_and_set_bit(FBLOCK_SUB_QUEUED, &sub->state))
+		return 0;
+
+	kref_get(&sub->ref);
+	q = &get_cpu_var(fblock_events);
+	spin_lock_bh(&q->lock);
+	list_add_tail(&sub->queue, &q->list);
+	spin_unlock_bh(&q->lock);
+	schedule_work_on(smp_processor_id(), &q->work);
+	put_cpu_var(fblock_events);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(notify_fblock_subscribers);
+
+static void fblock_update_selfref(struct fblock_subscrib *sub,
+				  struct fblock *self)
+{
+	struct fblock_notifier *fn;
+
+	list_for_each_entry(fn, &sub->subscriptions, own_list)
+		rcu_assign_pointer(fn->self, self);
+}
+
 /*
  * Migrate src to dst, both are of same type, working data is
  * transferred to dst and droped from src. src gets dsts old data,
@@ -220,6 +432,7 @@ static void fblock_update_selfref(struct fblock_notifier *head,
 void fblock_migrate_p(struct fblock *dst, struct fblock *src)
 {
 	void *priv_old;
+	struct fblock_ports *ports_old;
 
 	get_fblock(dst);
 	get_fblock(src);
@@ -228,6 +441,13 @@ void fblock_migrate_p(struct fblock *dst, struct fblock *src)
 	rcu_assign_pointer(dst->private_data, src->private_data);
 	rcu_assign_pointer(src->private_data, priv_old);
 
+	spin_lock_bh(&fblock_ports_lock);
+	ports_old = rcu_dereference_raw(dst->ports);
+	rcu_assign_pointer(dst->ports, rcu_dereference_raw(src->ports));
+	rcu_assign_pointer(src->ports, ports_old);
+	spin_unlock_bh(&fblock_ports_lock);
+	fblock_topology_changed();
+
 	put_fblock(dst);
 	put_fblock(src);
 }
@@ -235,7 +455,6 @@ EXPORT_SYMBOL_GPL(fblock_migrate_p);
 
 void fblock_migrate_r(struct fblock *dst, struct fblock *src)
 {
-	struct fblock_notifier *not_old;
 	struct fblock_subscrib *sub_old;
 
 	get_fblock(dst);
@@ -247,22 +466,21 @@ void fblock_migrate_r(struct fblock *dst, struct fblock *src)
 	dst->idp = src->idp;
 	strlcpy(dst->name, src->name, sizeof(dst->name));
 
-	rcu_assign_pointer(not_old, dst->notifiers);
-	rcu_assign_pointer(dst->notifiers, src->notifiers);
-	rcu_assign_pointer(src->notifiers, not_old);
-
-	fblock_update_selfref(dst->notifiers, dst);
-	fblock_update_selfref(src->notifiers, src);
-
+	spin_lock_bh(&fblock_subs_lock);
 	rcu_assign_pointer(sub_old, dst->others);
 	rcu_assign_pointer(dst->others, src->others);
 	rcu_assign_pointer(src->others, sub_old);
 
+	fblock_update_selfref(dst->others, dst);
+	fblock_update_selfref(src->others, src);
+	spin_unlock_bh(&fblock_subs_lock);
+
 	atomic_xchg(&dst->refcnt, atomic_xchg(&src->refcnt,
 					      atomic_read(&dst->refcnt)));
 
 	spin_unlock(&src->lock);
 	spin_unlock(&dst->lock);
+	fblock_topology_changed();
 
 	put_fblock(dst);
 	put_fblock(src);
@@ -270,9 +488,10 @@ void fblock_migrate_r(struct fblock *dst, struct fblock *src)
 EXPORT_SYMBOL_GPL(fblock_migrate_r);
 
 /*
- * fb1 on top of fb2 in the stack
+ * fb1 on top of fb2 in the stack, fb2 on fb1's given port
  */
-int __fblock_bind(struct fblock *fb1, struct fblock *fb2)
+int __fblock_bind_to_port(struct fblock *fb1, struct fblock *fb2,
+			  unsigned int port)
 {
 	int ret;
 	struct fblock_bind_msg msg;
@@ -288,6 +507,7 @@ int __fblock_bind(struct fblock *fb1, struct fblock *fb2)
 
 	msg.dir = TYPE_EGRESS;
 	msg.idp = fb2->idp;
+	msg.port = port;
 	fbn.self = fb1;
 	ret = fb1->event_rx(&fbn.nb, FBLOCK_BIND_IDP, &msg);
 	if (ret != NOTIFY_OK) {
@@ -298,12 +518,14 @@ int __fblock_bind(struct fblock *fb1, struct fblock *fb2)
 
 	msg.dir = TYPE_INGRESS;
 	msg.idp = fb1->idp;
+	msg.port = TYPE_INGRESS;
 	fbn.self = fb2;
 	ret = fb2->event_rx(&fbn.nb, FBLOCK_BIND_IDP, &msg);
 	if (ret != NOTIFY_OK) {
 		/* Release previous binding */
 		msg.dir = TYPE_EGRESS;
 		msg.idp = fb2->idp;
+		msg.port = port;
 		fbn.self = fb1;
 		ret = fb1->event_rx(&fbn.nb, FBLOCK_UNBIND_IDP, &msg);
 		if (ret != NOTIFY_OK)
@@ -315,35 +537,51 @@ int __fblock_bind(struct fblock *fb1, struct fblock *fb2)
 
 	ret = subscribe_to_remote_fblock(fb1, fb2);
 	if (ret) {
-		__fblock_unbind(fb1, fb2);
+		__fblock_unbind_from_port(fb1, fb2, port);
 		return -ENOMEM;
 	}
 
 	ret = subscribe_to_remote_fblock(fb2, fb1);
 	if (ret) {
-		__fblock_unbind(fb1, fb2);
+		__fblock_unbind_from_port(fb1, fb2, port);
 		return -ENOMEM;
 	}
 
+	fblock_topology_changed();
+
 	/* We don't give refcount back! */
 	return 0;
 }
-EXPORT_SYMBOL_GPL(__fblock_bind);
+EXPORT_SYMBOL_GPL(__fblock_bind_to_port);
 
-int fblock_bind(struct fblock *fb1, struct fblock *fb2)
+int fblock_bind_to_port(struct fblock *fb1, struct fblock *fb2,
+			unsigned int port)
 {
 	int ret;
 	rcu_read_lock();
-	ret = __fblock_bind(fb1, fb2);
+	ret = __fblock_bind_to_port(fb1, fb2, port);
 	rcu_read_unlock();
 	return ret;
 }
+EXPORT_SYMBOL_GPL(fblock_bind_to_port);
+
+int __fblock_bind(struct fblock *fb1, struct fblock *fb2)
+{
+	return __fblock_bind_to_port(fb1, fb2, TYPE_EGRESS);
+}
+EXPORT_SYMBOL_GPL(__fblock_bind);
+
+int fblock_bind(struct fblock *fb1, struct fblock *fb2)
+{
+	return fblock_bind_to_port(fb1, fb2, TYPE_EGRESS);
+}
 EXPORT_SYMBOL_GPL(fblock_bind);
 
 /*
- * fb1 on top of fb2 in the stack
+ * fb1 on top of fb2 in the stack, fb2 on fb1's given port
  */
-int __fblock_unbind(struct fblock *fb1, struct fblock *fb2)
+int __fblock_unbind_from_port(struct fblock *fb1, struct fblock *fb2,
+			      unsigned int port)
 {
 	int ret;
 	struct fblock_bind_msg msg;
@@ -358,6 +596,7 @@ int __fblock_unbind(struct fblock *fb1, struct fblock *fb2)
 
 	msg.dir = TYPE_EGRESS;
 	msg.idp = fb2->idp;
+	msg.port = port;
 	fbn.self = fb1;
 	ret = fb1->event_rx(&fbn.nb, FBLOCK_UNBIND_IDP, &msg);
 	if (ret != NOTIFY_OK) {
@@ -367,6 +606,7 @@ int __fblock_unbind(struct fblock *fb1, struct fblock *fb2)
 
 	msg.dir = TYPE_INGRESS;
 	msg.idp = fb1->idp;
+	msg.port = TYPE_INGRESS;
 	fbn.self = fb2;
 	ret = fb2->event_rx(&fbn.nb, FBLOCK_UNBIND_IDP, &msg);
 	if (ret != NOTIFY_OK) {
@@ -378,24 +618,326 @@ int __fblock_unbind(struct fblock *fb1, struct fblock *fb2)
 
 	unsubscribe_from_remote_fblock(fb1, fb2);
 	unsubscribe_from_remote_fblock(fb2, fb1);
+	fblock_topology_changed();
 
 	put_fblock(fb2);
 	put_fblock(fb1);
 
 	return 0;
 }
-EXPORT_SYMBOL_GPL(__fblock_unbind);
+EXPORT_SYMBOL_GPL(__fblock_unbind_from_port);
 
-int fblock_unbind(struct fblock *fb1, struct fblock *fb2)
+int fblock_unbind_from_port(struct fblock *fb1, struct fblock *fb2,
+			    unsigned int port)
 {
 	int ret;
 	rcu_read_lock();
-	ret = __fblock_unbind(fb1, fb2);
+	ret = __fblock_unbind_from_port(fb1, fb2, port);
 	rcu_read_unlock();
 	return ret;
 }
+EXPORT_SYMBOL_GPL(fblock_unbind_from_port);
+
+int __fblock_unbind(struct fblock *fb1, struct fblock *fb2)
+{
+	return __fblock_unbind_from_port(fb1, fb2, TYPE_EGRESS);
+}
+EXPORT_SYMBOL_GPL(__fblock_unbind);
+
+int fblock_unbind(struct fblock *fb1, struct fblock *fb2)
+{
+	return fblock_unbind_from_port(fb1, fb2, TYPE_EGRESS);
+}
 EXPORT_SYMBOL_GPL(fblock_unbind);
 
+static struct fblock_table *fblock_table_alloc(unsigned int size)
+{
+	size_t len;
+	struct fblock_table *tab;
+
+	len = sizeof(*tab) + size * sizeof(tab->slot[0]);
+	if (len <= PAGE_SIZE)
+		tab = kzalloc(len, GFP_KERNEL);
+	else
+		tab = vzalloc(len);
+	if (!tab)
+		return NULL;
+	tab->size = size;
+
+	return tab;
+}
+
+static void fblock_table_free(struct fblock_table *tab)
+{
+	if (is_vmalloc_addr(tab))
+		vfree(tab);
+	else
+		kfree(tab);
+}
+
+static inline struct fblock_table *fblock_table_locked(void)
+{
+	return rcu_dereference_protected(fbltab,
+					 lockdep_is_held(&fbltab_lock));
+}
+
+/*
+ * Replaces table and idp map by ones of the given size, must hold
+ * fbltab_lock. On shrinking, all slots and idps above size must be free.
+ */
+static struct fblock_table *fblock_table_resize(unsigned int size)
+{
+	unsigned int i;
+	unsigned long *map, *old_map;
+	struct fblock_table *tab = fblock_table_locked(), *new;
+
+	new = fblock_table_alloc(size);
+	if (!new)
+		return NULL;
+	map = kcalloc(BITS_TO_LONGS(size), sizeof(*map), GFP_KERNEL);
+	if (!map) {
+		fblock_table_free(new);
+		return NULL;
+	}
+
+	for (i = 0; i < min(tab->size, size); ++i)
+		RCU_INIT_POINTER(new->slot[i],
+				 rcu_dereference_protected(tab->slot[i], 1));
+
+	spin_lock_bh(&idp_map_lock);
+	bitmap_copy(map, idp_map, min(tab->size, size));
+	old_map = idp_map;
+	idp_map = map;
+	spin_unlock_bh(&idp_map_lock);
+	kfree(old_map);
+
+	rcu_assign_pointer(fbltab, new);
+	synchronize_rcu();
+	fblock_table_free(tab);
+
+	return new;
+}
+
+/* Grows the table so that idp fits in, must hold fbltab_lock. */
+static inline struct fblock_table *fblock_table_grow(idp_t idp)
+{
+	return fblock_table_resize(max_t(unsigned int,
+					 fblock_table_locked()->size << 1,
+					 roundup_pow_of_two(idp + 1)));
+}
+
+/*
+ * Halves the table as long as at most a quarter of it is in use, so
+ * that it does not flap around a power of two boundary.
+ */
+static void fblock_table_shrink_work(struct work_struct *work)
+{
+	unsigned int size, last;
+	struct fblock_table *tab;
+
+	mutex_lock(&fbltab_lock);
+	tab = fblock_table_locked();
+	for (size = tab->size; size > FBLTAB_MIN_SIZE; size >>= 1) {
+		spin_lock_bh(&idp_map_lock);
+		last = find_last_bit(idp_map, tab->size);
+		spin_unlock_bh(&idp_map_lock);
+		if (last < tab->size && last >= (size >> 2))
+			break;
+	}
+	if (size < tab->size)
+		fblock_table_resize(size);
+	mutex_unlock(&fbltab_lock);
+}
+
+static int fblock_table_insert(idp_t idp, struct fblock *p)
+{
+	int ret = 0;
+	struct fblock_table *tab;
+
+	mutex_lock(&fbltab_lock);
+	tab = fblock_table_locked();
+	if (idp >= tab->size) {
+		tab = fblock_table_grow(idp);
+		if (!tab) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	if (rcu_dereference_protected(tab->slot[idp], 1)) {
+		ret = -EEXIST;
+		goto out;
+	}
+	/* Keep insert_new and the shrink work off this idp */
+	spin_lock_bh(&idp_map_lock);
+	__set_bit(idp, idp_map);
+	spin_unlock_bh(&idp_map_lock);
+	rcu_assign_pointer(tab->slot[idp], p);
+out:
+	mutex_unlock(&fbltab_lock);
+	return ret;
+}
+
+/*
+ * Hands out the lowest free idp and inserts p there, so that the table
+ * stays densely populated from the bottom.
+ */
+static int fblock_table_insert_new(struct fblock *p)
+{
+	int ret = 0;
+	unsigned int idp;
+	struct fblock_table *tab;
+
+	mutex_lock(&fbltab_lock);
+	tab = fblock_table_locked();
+	spin_lock_bh(&idp_map_lock);
+	/* idp 0 is IDP_UNKNOWN */
+	idp = find_next_zero_bit(idp_map, tab->size, 1);
+	if (idp < tab->size)
+		__set_bit(idp, idp_map);
+	spin_unlock_bh(&idp_map_lock);
+	if (idp >= tab->size) {
+		tab = fblock_table_grow(idp);
+		if (!tab) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		spin_lock_bh(&idp_map_lock);
+		__set_bit(idp, idp_map);
+		spin_unlock_bh(&idp_map_lock);
+	}
+	if (unlikely(rcu_dereference_protected(tab->slot[idp], 1))) {
+		ret = -EEXIST;
+		goto out;
+	}
+	p->idp = idp;
+	rcu_assign_pointer(tab->slot[idp], p);
+out:
+	mutex_unlock(&fbltab_lock);
+	return ret;
+}
+
+static void fblock_table_delete(idp_t idp)
+{
+	struct fblock_table *tab;
+
+	mutex_lock(&fbltab_lock);
+	tab = fblock_table_locked();
+	if (idp < tab->size)
+		RCU_INIT_POINTER(tab->slot[idp], NULL);
+	mutex_unlock(&fbltab_lock);
+}
+
+static void fblock_idp_release_rcu(struct rcu_head *rp)
+{
+	struct idp_release *rel = container_of(rp, struct idp_release, rcu);
+
+	latency_forget(rel->idp);
+	spin_lock_bh(&idp_map_lock);
+	__clear_bit(rel->idp, idp_map);
+	spin_unlock_bh(&idp_map_lock);
+	kfree(rel);
+
+	schedule_work(&fbltab_shrink);
+}
+
+/* Gives the idp back to the allocator once all readers are done with it. */
+static void fblock_idp_release(idp_t idp)
+{
+	struct idp_release *rel;
+
+	if (idp == IDP_UNKNOWN)
+		return;
+	rel = kmalloc(sizeof(*rel), GFP_ATOMIC);
+	if (unlikely(!rel)) {
+		/* Rather leak the idp than reuse it early */
+		printk(KERN_WARNING "[lana] Cannot release IDP%u!\n", idp);
+		return;
+	}
+	rel->idp = idp;
+	call_rcu(&rel->rcu, fblock_idp_release_rcu);
+}
+
+/*
+ * Puts dst in place of src at src's idp. dst takes over src's name and
+ * subscriptions and a copy of its ports first. The idp slot is then
+ * switched with a single pointer store, so that in-flight packets find
+ * either of both and none get lost. The check that src is still
+ * registered and the switch happen under fbltab_lock, so that src cannot
+ * be unregistered and its idp handed out again in between. If
+ * migrate_priv is set, dst takes over src's private data only after a
+ * grace period, when no CPU can still be running src, since no block's
+ * private data is made for two writers. Until then dst runs on its own.
+ * src gets dst's leftover state back and is released. dst must not be
+ * in the namespace anymore. If src is not registered, -ENOENT is
+ * returned and dst is left as it was. Called in process context, not
+ * under RCU, with references held on both.
+ */
+int fblock_replace(struct fblock *dst, struct fblock *src, int migrate_priv)
+{
+	int ret = 0;
+	void *priv_old;
+	struct fblock_table *tab;
+	struct fblock_ports *ports_old, *ports_new;
+
+	might_sleep();
+
+	get_fblock(dst);
+	get_fblock(src);
+
+	mutex_lock(&fbltab_lock);
+	tab = fblock_table_locked();
+	if (__fblock_table_lookup(tab, src->idp) != src) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	/* dst gets its own copy, both may be (un)bound independently */
+	spin_lock_bh(&fblock_ports_lock);
+	ports_old = rcu_dereference_protected(dst->ports,
+				lockdep_is_held(&fblock_ports_lock));
+	ports_new = rcu_dereference_protected(src->ports,
+				lockdep_is_held(&fblock_ports_lock));
+	ports_new = fblock_ports_alloc(ports_new->num, ports_new);
+	if (!ports_new) {
+		spin_unlock_bh(&fblock_ports_lock);
+		ret = -ENOMEM;
+		goto out;
+	}
+	rcu_assign_pointer(dst->ports, ports_new);
+	spin_unlock_bh(&fblock_ports_lock);
+	kfree_rcu(ports_old, rcu);
+
+	fblock_migrate_r(dst, src);
+
+	rcu_assign_pointer(tab->slot[dst->idp], dst);
+	mutex_unlock(&fbltab_lock);
+	fblock_topology_changed();
+
+	/* Quiescence, after this nobody runs src anymore */
+	synchronize_rcu();
+
+	if (migrate_priv) {
+		/* dst's readers of priv_old are done before src is freed */
+		priv_old = rcu_dereference_raw(dst->private_data);
+		rcu_assign_pointer(dst->private_data,
+				   rcu_dereference_raw(src->private_data));
+		rcu_assign_pointer(src->private_data, priv_old);
+	}
+
+	put_fblock(dst);
+	put_fblock(src);
+	/* Drop src's registration, refcnts were swapped before */
+	put_fblock(src);
+
+	return 0;
+out:
+	mutex_unlock(&fbltab_lock);
+	put_fblock(dst);
+	put_fblock(src);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(fblock_replace);
+
 /*
  * register_fblock is called when the idp is preknown to the
  * caller and has already been registered previously. The previous
@@ -404,8 +946,11 @@ EXPORT_SYMBOL_GPL(fblock_unbind);
  */
 int register_fblock(struct fblock *p, idp_t idp)
 {
+	int ret;
 	p->idp = idp;
-	return radix_tree_insert(&fblmap, idp, p);
+	ret = fblock_table_insert(idp, p);
+	fblock_topology_changed();
+	return ret;
 }
 EXPORT_SYMBOL_GPL(register_fblock);
 
@@ -417,11 +962,19 @@ EXPORT_SYMBOL_GPL(register_fblock);
 int register_fblock_namespace(struct fblock *p)
 {
 	int ret;
-	p->idp = provide_new_fblock_idp();
-	ret = radix_tree_insert(&fblmap, p->idp, p);
+	ret = fblock_table_insert_new(p);
 	if (ret < 0)
 		return ret;
-	return register_to_fblock_namespace(p->name, p->idp);
+	ret = register_to_fblock_namespace(p->name, p->idp);
+	if (ret < 0) {
+		/* Nobody may find p under an idp that is not named */
+		fblock_table_delete(p->idp);
+		fblock_idp_release(p->idp);
+		p->idp = IDP_UNKNOWN;
+		return ret;
+	}
+	fblock_topology_changed();
+	return 0;
 }
 EXPORT_SYMBOL_GPL(register_fblock_namespace);
 
@@ -440,7 +993,8 @@ EXPORT_SYMBOL_GPL(free_fblock_rcu);
  */
 void unregister_fblock(struct fblock *p)
 {
-	radix_tree_delete(&fblmap, p->idp);
+	fblock_table_delete(p->idp);
+	fblock_topology_changed();
 	put_fblock(p);
 }
 EXPORT_SYMBOL_GPL(unregister_fblock);
@@ -451,8 +1005,10 @@ EXPORT_SYMBOL_GPL(unregister_fblock);
  */
 static void __unregister_fblock_namespace(struct fblock *p, int rcu)
 {
-	radix_tree_delete(&fblmap, p->idp);
+	fblock_table_delete(p->idp);
 	unregister_from_fblock_namespace(p->name);
+	fblock_idp_release(p->idp);
+	fblock_topology_changed();
 	if (rcu)
 		put_fblock(p);
 }
@@ -472,6 +1028,7 @@ EXPORT_SYMBOL_GPL(unregister_fblock_namespace_no_rcu);
 /* If state changes on 'remote' fb, we ('us') want to be notified. */
 int subscribe_to_remote_fblock(struct fblock *us, struct fblock *remote)
 {
+	struct fblock_subscrib *own, *sub;
 	struct fblock_notifier *fn = kmalloc(sizeof(*fn), GFP_ATOMIC);
 	if (!fn)
 		return -ENOMEM;
@@ -479,48 +1036,47 @@ int subscribe_to_remote_fblock(struct fblock *us, struct fblock *remote)
 	get_fblock(us);
 	get_fblock(remote);
 
-	spin_lock(&us->lock);
 	fn->self = us;
 	fn->remote = remote->idp;
 	init_fblock_subscriber(us, &fn->nb);
-	fn->next = rcu_dereference_raw(us->notifiers);
-	rcu_assign_pointer(us->notifiers, fn);
-	spin_unlock(&us->lock);
 
-	return fblock_register_foreign_subscriber(remote,
-			&rcu_dereference_raw(us->notifiers)->nb);
+	spin_lock_bh(&fblock_subs_lock);
+	own = rcu_dereference_raw(us->others);
+	sub = rcu_dereference_raw(remote->others);
+	fn->owner = own;
+	hlist_add_head(&fn->hash, fblock_subs_bucket(own, fn->remote));
+	list_add_tail_rcu(&fn->own_list, &own->subscriptions);
+	list_add_tail_rcu(&fn->sub_list, &sub->subscribers);
+	spin_unlock_bh(&fblock_subs_lock);
+
+	return 0;
 }
 EXPORT_SYMBOL_GPL(subscribe_to_remote_fblock);
 
 void unsubscribe_from_remote_fblock(struct fblock *us, struct fblock *remote)
 {
 	int found = 0;
+	struct hlist_node *node;
 	struct fblock_notifier *fn;
-
-	if (unlikely(!rcu_dereference_raw(us->notifiers)))
-		return;
-	spin_lock(&us->lock);
-	fn = rcu_dereference_raw(us->notifiers);
-	if (fn->remote == remote->idp)
-		rcu_assign_pointer(us->notifiers, us->notifiers->next);
-	else {
-		struct fblock_notifier *f1;
-		while ((f1 = fn->next)) {
-			if (f1->remote == remote->idp) {
-				found = 1;
-				fn->next = f1->next;
-				fn = f1; /* free f1 */
-				break;
-			} else
-				fn = f1;
+	struct fblock_subscrib *own;
+
+	spin_lock_bh(&fblock_subs_lock);
+	own = rcu_dereference_raw(us->others);
+	hlist_for_each_entry(fn, node, fblock_subs_bucket(own, remote->idp),
+			     hash) {
+		if (fn->owner == own && fn->remote == remote->idp) {
+			hlist_del(&fn->hash);
+			list_del_rcu(&fn->own_list);
+			list_del_rcu(&fn->sub_list);
+			found = 1;
+			break;
 		}
 	}
-	spin_unlock(&us->lock);
-	if (found) {
-		fblock_unregister_foreign_subscriber(remote, &fn->nb);
-		kfree(fn);
-	}
+	spin_unlock_bh(&fblock_subs_lock);
+	if (!found)
+		return;
 
+	kfree_rcu(fn, rcu);
 	/* drop ref */
 	put_fblock(us);
 	put_fblock(remote);
@@ -553,20 +1109,70 @@ struct fblock *alloc_fblock(gfp_t flags)
 }
 EXPORT_SYMBOL_GPL(alloc_fblock);
 
-int init_fblock(struct fblock *fb, char *name, void __percpu *priv)
+struct fblock_lazy *fblock_lazy_alloc(void)
 {
+	return kzalloc(nr_cpu_ids * sizeof(void *), GFP_ATOMIC);
+}
+EXPORT_SYMBOL_GPL(fblock_lazy_alloc);
+
+void *__fblock_lazy_get(struct fblock_lazy *lazy, size_t size,
+			unsigned int cpu)
+{
+	void *p, *old;
+
+	p = kzalloc_node(size, GFP_ATOMIC, cpu_to_node(cpu));
+	if (unlikely(!p))
+		return NULL;
+	/* Process context on the same CPU might have been faster */
+	old = cmpxchg(&lazy->cpu[cpu], NULL, p);
+	if (unlikely(old)) {
+		kfree(p);
+		p = old;
+	}
+
+	return p;
+}
+EXPORT_SYMBOL_GPL(__fblock_lazy_get);
+
+void fblock_lazy_free(struct fblock_lazy *lazy)
+{
+	unsigned int cpu;
+
+	if (!lazy)
+		return;
+	for_each_possible_cpu(cpu)
+		kfree(lazy->cpu[cpu]);
+	kfree(lazy);
+}
+EXPORT_SYMBOL_GPL(fblock_lazy_free);
+
+int init_fblock_ports(struct fblock *fb, char *name, void *priv,
+		      unsigned int num_ports)
+{
+	fb->stats = fblock_lazy_alloc();
+	if (!fb->stats)
+		return -ENOMEM;
+	RCU_INIT_POINTER(fb->ports, fblock_ports_alloc(num_ports, NULL));
+	if (!rcu_dereference_raw(fb->ports)) {
+		fblock_lazy_free(fb->stats);
+		return -ENOMEM;
+	}
 	spin_lock(&fb->lock);
 	strlcpy(fb->name, name, sizeof(fb->name));
 	rcu_assign_pointer(fb->private_data, priv);
-	fb->others = kmalloc(sizeof(*(fb->others)), GFP_ATOMIC);
-	if (!fb->others)
+	fb->netfb_rx_bulk = NULL;
+	fb->others = fblock_subscrib_alloc();
+	if (!fb->others) {
+		spin_unlock(&fb->lock);
+		kfree(rcu_dereference_raw(fb->ports));
+		fblock_lazy_free(fb->stats);
 		return -ENOMEM;
-	ATOMIC_INIT_NOTIFIER_HEAD(&fb->others->subscribers);
+	}
 	spin_unlock(&fb->lock);
 	atomic_set(&fb->refcnt, 1);
 	return 0;
 }
-EXPORT_SYMBOL_GPL(init_fblock);
+EXPORT_SYMBOL_GPL(init_fblock_ports);
 
 void kfree_fblock(struct fblock *p)
 {
@@ -581,31 +1187,38 @@ EXPORT_SYMBOL_GPL(kfree_fblock);
 
 void cleanup_fblock(struct fblock *fb)
 {
-	notify_fblock_subscribers(fb, FBLOCK_DOWN, &fb->idp);
+	notify_fblock_subscribers(fb, FBLOCK_DOWN);
+	fblock_topology_changed();
 	if (fb->factory)
 		fb->factory->dtor(fb);
-	kfree(rcu_dereference_raw(fb->others));
+	fblock_subscrib_put(rcu_dereference_raw(fb->others));
+	kfree(rcu_dereference_raw(fb->ports));
+	fblock_lazy_free(fb->stats);
 }
 EXPORT_SYMBOL_GPL(cleanup_fblock);
 
 void cleanup_fblock_ctor(struct fblock *fb)
 {
-	kfree(rcu_dereference_raw(fb->others));
+	fblock_subscrib_put(rcu_dereference_raw(fb->others));
+	kfree(rcu_dereference_raw(fb->ports));
+	fblock_lazy_free(fb->stats);
 }
 EXPORT_SYMBOL_GPL(cleanup_fblock_ctor);
 
 static int procfs_fblocks(char *page, char **start, off_t offset,
 			  int count, int *eof, void *data)
 {
-	int i, has_sub;
+	int has_sub;
+	unsigned int i;
 	off_t len = 0;
 	struct fblock *fb;
 	struct fblock_notifier *fn;
-	long long max = atomic64_read(&idp_counter);
+	struct fblock_table *tab;
 
 	rcu_read_lock();
-	for (i = 0; i <= max; ++i) {
-		fb = radix_tree_lookup(&fblmap, i);
+	tab = rcu_dereference_raw(fbltab);
+	for (i = 0; i < tab->size; ++i) {
+		fb = __fblock_table_lookup(tab, i);
 		if (!fb)
 			continue;
 		has_sub = 0;
@@ -613,10 +1226,9 @@ static int procfs_fblocks(char *page, char **start, off_t offset,
 			       fb->name, fb->factory ? fb->factory->type : "vlink",
 			       fb, fb->idp,
 			       atomic_read(&fb->refcnt));
-		fn = rcu_dereference_raw(fb->notifiers);
-		while (fn) {
+		list_for_each_entry_rcu(fn, &rcu_dereference_raw(fb->others)->subscriptions,
+					own_list) {
 			len += sprintf(page + len, "%u ", fn->remote);
-			rcu_assign_pointer(fn, fn->next);
 			has_sub = 1;
 		}
 		len += sprintf(page + len - has_sub, "]\n");
@@ -628,26 +1240,108 @@ static int procfs_fblocks(char *page, char **start, off_t offset,
 	return len;
 }
 
+void fblock_stats_sum(struct fblock *fb, struct fblock_stats *sum)
+{
+	unsigned int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct fblock_stats *stats_cpu = fblock_lazy_cpu(fb->stats, cpu);
+		if (!stats_cpu)
+			continue;
+		sum->pkts += stats_cpu->pkts;
+		sum->bytes += stats_cpu->bytes;
+		sum->drops += stats_cpu->drops;
+		sum->cycles += stats_cpu->cycles;
+	}
+}
+EXPORT_SYMBOL_GPL(fblock_stats_sum);
+
+static int fblock_proc_show_stats(struct seq_file *m, void *v)
+{
+	unsigned int i;
+	struct fblock *fb;
+	struct fblock_stats sum;
+	struct fblock_table *tab;
+
+	seq_puts(m, "name idp pkts bytes drops cycles cycles/pkt\n");
+	rcu_read_lock();
+	tab = rcu_dereference_raw(fbltab);
+	for (i = 0; i < tab->size; ++i) {
+		fb = __fblock_table_lookup(tab, i);
+		if (!fb)
+			continue;
+		fblock_stats_sum(fb, &sum);
+		seq_printf(m, "%s %u %llu %llu %llu %llu %llu\n",
+			   fb->name, fb->idp, sum.pkts, sum.bytes,
+			   sum.drops, sum.cycles, sum.pkts ?
+			   div64_u64(sum.cycles, sum.pkts) : 0);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static int fblock_proc_open_stats(struct inode *inode, struct file *file)
+{
+	return single_open(file, fblock_proc_show_stats, NULL);
+}
+
+static const struct file_operations fblock_proc_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = fblock_proc_open_stats,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 int init_fblock_tables(void)
 {
 	int ret = 0;
-
+	unsigned int cpu;
+
+	fblock_check_layout();
+	for_each_possible_cpu(cpu) {
+		struct fblock_event_queue *q = &per_cpu(fblock_events, cpu);
+		spin_lock_init(&q->lock);
+		INIT_LIST_HEAD(&q->list);
+		INIT_WORK(&q->work, fblock_events_drain);
+	}
 	get_critbit_cache();
 	critbit_init_tree(&idpmap);
+	RCU_INIT_POINTER(fbltab, fblock_table_alloc(FBLTAB_MIN_SIZE));
+	if (!rcu_dereference_raw(fbltab)) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	idp_map = kcalloc(BITS_TO_LONGS(FBLTAB_MIN_SIZE), sizeof(*idp_map),
+			  GFP_KERNEL);
+	if (!idp_map) {
+		ret = -ENOMEM;
+		goto err1;
+	}
 	fblock_cache = kmem_cache_create("fblock", sizeof(struct fblock),
 					 0, SLAB_HWCACHE_ALIGN |
 					 SLAB_MEM_SPREAD | SLAB_RECLAIM_ACCOUNT,
 					 ctor_fblock);
 	if (!fblock_cache)
-		goto err;
-	atomic64_set(&idp_counter, 0);
+		goto err1;
 	fblocks_proc = create_proc_read_entry("fblocks", 0400, lana_proc_dir,
 					      procfs_fblocks, NULL);
 	if (!fblocks_proc)
 		goto err2;
+	fbstats_proc = proc_create("fbstats", 0400, lana_proc_dir,
+				   &fblock_proc_stats_fops);
+	if (!fbstats_proc)
+		goto err3;
 	return 0;
+err3:
+	remove_proc_entry("fblocks", lana_proc_dir);
 err2:
 	kmem_cache_destroy(fblock_cache);
+err1:
+	kfree(idp_map);
+	fblock_table_free(rcu_dereference_raw(fbltab));
 err:
 	put_critbit_cache();
 	return ret;
@@ -656,10 +1350,19 @@ EXPORT_SYMBOL_GPL(init_fblock_tables);
 
 void cleanup_fblock_tables(void)
 {
+	unsigned int cpu;
+
+	remove_proc_entry("fbstats", lana_proc_dir);
 	remove_proc_entry("fblocks", lana_proc_dir);
 	put_critbit_cache();
+	/* Pending frees may still queue events and shrinks */
 	rcu_barrier();
+	for_each_possible_cpu(cpu)
+		flush_work(&per_cpu(fblock_events, cpu).work);
+	cancel_work_sync(&fbltab_shrink);
 	kmem_cache_destroy(fblock_cache);
+	kfree(idp_map);
+	fblock_table_free(rcu_dereference_raw(fbltab));
 }
 EXPORT_SYMBOL_GPL(cleanup_fblock_tables);
 
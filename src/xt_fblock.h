@@ -18,7 +18,8 @@
 #include <linux/spinlock.h>
 #include <linux/skbuff.h>
 #include <linux/notifier.h>
-#include <linux/radix-tree.h>
+#include <linux/list.h>
+#include <linux/kref.h>
 
 #include "xt_idp.h"
 
@@ -58,9 +59,11 @@ enum fblock_mode {
 
 extern struct proc_dir_entry *fblock_proc_dir;
 
+/* port is the index into the port table, dir for plain binds */
 struct fblock_bind_msg {
 	enum path_type dir;
 	idp_t idp;
+	unsigned int port;
 };
 
 struct fblock_opt_msg {
@@ -76,37 +79,141 @@ struct fblock_factory {
 	struct module *owner;
 	struct fblock *(*ctor)(char *name);
 	void (*dtor)(struct fblock *fb);
-	void (*dtor_outside_rcu)(struct fblock *fb);
 } ____cacheline_aligned;
 
+/*
+ * One subscription of self to remote. It sits on the subscriptions list of
+ * self, on the subscribers list of remote and in a global hash by
+ * (owner, remote), so that unsubscribing does not walk any list.
+ */
 struct fblock_notifier {
 	struct fblock *self;
 	struct notifier_block nb;
-	struct fblock_notifier *next;
+	struct fblock_subscrib *owner;
+	struct hlist_node hash;
+	struct list_head own_list;
+	struct list_head sub_list;
+	struct rcu_head rcu;
 	idp_t remote;
 };
 
+/*
+ * Events are not delivered where they are raised. The fblock's bit for
+ * the event is set in pending and the fblock_subscrib is put on a per-CPU
+ * queue once; a worker delivers everything pending later on. Thus the
+ * same event raised several times before the worker runs is delivered
+ * once. Subscribers get a pointer to the source idp as argument.
+ */
 struct fblock_subscrib {
-	struct atomic_notifier_head subscribers;
+	struct list_head subscribers;
+	struct list_head subscriptions;
+	struct list_head queue;
+	unsigned long pending;
+	unsigned long state;
+	struct kref ref;
+	struct rcu_head rcu;
+	idp_t idp;
+};
+
+/* Per-CPU accounting, only filled in if the engine's ppe_fb_stats is on */
+struct fblock_stats {
+	u64 pkts;
+	u64 bytes;
+	u64 drops;
+	u64 cycles;
+};
+
+/*
+ * Per-CPU state that is only created on the CPUs that actually use it,
+ * i.e. on the first packet there, instead of up front on all of them.
+ * There is a slot per possible CPU; once set, it stays until the whole
+ * thing is freed. Blocks whose per-CPU state would be the same read-only
+ * data everywhere should rather keep one shared copy in private_data.
+ */
+struct fblock_lazy {
+	void *cpu[0];
 };
 
+extern struct fblock_lazy *fblock_lazy_alloc(void);
+extern void fblock_lazy_free(struct fblock_lazy *lazy);
+extern void *__fblock_lazy_get(struct fblock_lazy *lazy, size_t size,
+			       unsigned int cpu);
+
+/* Zeroed on creation, NULL if that failed. Needs preemption disabled. */
+static inline void *fblock_lazy_this_cpu(struct fblock_lazy *lazy,
+					 size_t size)
+{
+	unsigned int cpu = smp_processor_id();
+	void *p = rcu_dereference_raw(lazy->cpu[cpu]);
+
+	if (unlikely(!p))
+		p = __fblock_lazy_get(lazy, size, cpu);
+	return p;
+}
+
+/* For summing up, NULL if the CPU never used it */
+static inline void *fblock_lazy_cpu(struct fblock_lazy *lazy, unsigned int cpu)
+{
+	return rcu_dereference_raw(lazy->cpu[cpu]);
+}
+
+/*
+ * Port configuration of a fblock, shared by all CPUs. It is never changed
+ * once published, bind and unbind replace it as a whole under RCU, so the
+ * data path gets a consistent view with a single dereference.
+ */
+struct fblock_ports {
+	struct rcu_head rcu;
+	unsigned int num;
+	idp_t port[0];
+};
+
+/*
+ * The first cacheline only holds what the engine reads per packet and is
+ * not written after registration. Everything mutable or only touched by
+ * the control path, refcnt in particular, starts on the next one. This is
+ * meant to keep control operations off the data path's copy, but has not
+ * been measured yet; bench_chain gives the per hop cost to compare with.
+ */
 struct fblock {
-	char name[FBNAMSIZ];
-	void __percpu *private_data;
+	/* Data path, read-mostly */
 	int (*netfb_rx)(const struct fblock * const fb,
 			struct sk_buff * const skb,
 			enum path_type * const dir);
+	/* Optional, all skbs are for this fblock with the same path type */
+	void (*netfb_rx_bulk)(const struct fblock * const fb,
+			      struct sk_buff ** const skbs,
+			      int * const rets, unsigned int num,
+			      enum path_type * const dir);
+	/* Shared or fblock_lazy, up to the fblock type */
+	void *private_data;
+	struct fblock_ports __rcu *ports;
+	struct fblock_lazy *stats;
+	idp_t idp;
+	/* Control path */
+	atomic_t refcnt ____cacheline_aligned_in_smp;
+	spinlock_t lock; /* Used in notifiers */
 	int (*event_rx)(struct notifier_block *self, unsigned long cmd,
 			void *args);
 	struct fblock_factory *factory;
-	struct fblock_notifier *notifiers;
 	struct fblock_subscrib *others;
 	struct rcu_head rcu;
-	atomic_t refcnt;
-	idp_t idp;
-	spinlock_t lock; /* Used in notifiers */
+	char name[FBNAMSIZ];
 } ____cacheline_aligned;
 
+/*
+ * Compile time check of the above layout, see init_fblock_tables(). On UP
+ * there is no other CPU to share the line with, refcnt is not moved.
+ */
+static inline void fblock_check_layout(void)
+{
+	BUILD_BUG_ON(offsetof(struct fblock, idp) + sizeof(idp_t) >
+		     L1_CACHE_BYTES);
+#ifdef CONFIG_SMP
+	BUILD_BUG_ON(offsetof(struct fblock, refcnt) < L1_CACHE_BYTES);
+#endif
+}
+
 extern void free_fblock_rcu(struct rcu_head *rp);
 
 static inline void get_fblock(struct fblock *fb)
@@ -118,11 +225,8 @@ static inline void put_fblock(struct fblock *fb)
 {
 	if (likely(!atomic_dec_and_test(&fb->refcnt)))
 		return;
-	if (fb->factory) {
-		if (fb->factory->dtor_outside_rcu)
-			fb->factory->dtor_outside_rcu(fb);
+	if (fb->factory)
 		call_rcu(&fb->rcu, free_fblock_rcu);
-	}
 }
 
 /*
@@ -133,8 +237,12 @@ static inline void put_fblock(struct fblock *fb)
 extern struct fblock *alloc_fblock(gfp_t flags);
 extern void kfree_fblock(struct fblock *p);
 
-/* Initialize/cleanup a fblock object. */
-extern int init_fblock(struct fblock *fb, char *name, void __percpu *priv);
+/*
+ * Initialize/cleanup a fblock object. The former variant gives the fblock
+ * num_ports ports, init_fblock() one per path type.
+ */
+extern int init_fblock_ports(struct fblock *fb, char *name,
+			     void *priv, unsigned int num_ports);
 extern void cleanup_fblock(struct fblock *fb);
 extern void cleanup_fblock_ctor(struct fblock *fb);
 
@@ -153,18 +261,68 @@ extern void unregister_fblock(struct fblock *p);
 extern void unregister_fblock_namespace(struct fblock *p);
 extern void unregister_fblock_namespace_no_rcu(struct fblock *p);
 
-extern struct radix_tree_root fblmap;
+/*
+ * idp to fblock translation table. idps are handed out densely, so a flat
+ * array indexed by idp turns a lookup into a single dependent load.
+ * Readers are lockless under RCU, writers grow the table by copy and
+ * publish.
+ */
+struct fblock_table {
+	unsigned int size;
+	struct fblock __rcu *slot[0];
+};
+
+extern struct fblock_table __rcu *fbltab;
+
+static inline struct fblock *__fblock_table_lookup(struct fblock_table *tab,
+						   idp_t idp)
+{
+	if (unlikely(idp >= tab->size))
+		return NULL;
+	return rcu_dereference_raw(tab->slot[idp]);
+}
+
+static inline struct fblock *fblock_table_lookup(idp_t idp)
+{
+	return __fblock_table_lookup(rcu_dereference_raw(fbltab), idp);
+}
+
+/*
+ * Bumped on every change of the graph, i.e. on (un)registration, bind,
+ * unbind, replace and down events. Caches of idp to fblock translations
+ * are only valid for the generation they were built in.
+ */
+extern atomic_t fblock_topology_gen;
+
+static inline unsigned int fblock_topology_read(void)
+{
+	unsigned int gen = atomic_read(&fblock_topology_gen);
+	smp_rmb();
+	return gen;
+}
 
 /* Caller needs to do a put_fblock() after his work is done! */
 /* Called within RCU read lock! */
 #define __search_fblock(idp)					\
 ({								\
-	struct fblock *ret = radix_tree_lookup(&fblmap, idp);	\
+	struct fblock *ret = fblock_table_lookup(idp);		\
 	if (likely(ret))					\
 		get_fblock(ret);				\
 	ret;							\
 })
 
+/*
+ * Data path variant that does not take a reference, so that the refcnt
+ * cacheline does not bounce between CPUs. The fblock is only valid until
+ * the caller leaves its RCU read-side critical section, since fblocks are
+ * freed after a grace period. Control path users must take a reference!
+ */
+#define __search_fblock_rcu(idp)				\
+({								\
+	struct fblock *ret = fblock_table_lookup(idp);		\
+	ret;							\
+})
+
 /* Returns fblock object specified by idp or name. */
 extern struct fblock *search_fblock(idp_t idp);
 extern struct fblock *search_fblock_n(char *name);
@@ -173,17 +331,51 @@ extern struct fblock *search_fblock_n(char *name);
 extern void fblock_migrate_p(struct fblock *dst, struct fblock *src);
 extern void fblock_migrate_r(struct fblock *dst, struct fblock *src);
 
+/* Atomically replaces src by dst in the graph, see xt_fblock.c. */
+extern int fblock_replace(struct fblock *dst, struct fblock *src,
+			  int migrate_priv);
+
+/* Port lookup for the data path, port must be below ports->num. */
+static inline idp_t fblock_port(const struct fblock * const fb,
+				unsigned int port)
+{
+	return rcu_dereference_raw(fb->ports)->port[port];
+}
+
+/*
+ * Bind/unbind idp to/from the given port of fb, meant to be called from
+ * the event_rx handler. Binding fails with -EBUSY if the port is already
+ * in use, unbinding with -ENOENT if idp is not bound to it.
+ */
+extern int fblock_bind_port(struct fblock *fb, unsigned int port, idp_t idp);
+extern int fblock_unbind_port(struct fblock *fb, unsigned int port,
+			      idp_t idp);
+
+/* Sums up the per-CPU statistics of fb. */
+extern void fblock_stats_sum(struct fblock *fb, struct fblock_stats *sum);
+
 /* Notify fblock of new option. */
 extern int fblock_set_option(struct fblock *fb, char *opt_string);
 extern int __fblock_set_option(struct fblock *fb, char *opt_string);
 
-/* Binds two fblock objects, increments refcount each. */
+/*
+ * Binds two fblock objects, increments refcount each. The port variants
+ * bind fb2 to the given port of fb1 instead of its egress port.
+ */
 extern int fblock_bind(struct fblock *fb1, struct fblock *fb2);
 extern int __fblock_bind(struct fblock *fb1, struct fblock *fb2);
+extern int fblock_bind_to_port(struct fblock *fb1, struct fblock *fb2,
+			       unsigned int port);
+extern int __fblock_bind_to_port(struct fblock *fb1, struct fblock *fb2,
+				 unsigned int port);
 
 /* Unbinds two fblock objects, decrements refcount each. */
 extern int fblock_unbind(struct fblock *fb1, struct fblock *fb2);
 extern int __fblock_unbind(struct fblock *fb1, struct fblock *fb2);
+extern int fblock_unbind_from_port(struct fblock *fb1, struct fblock *fb2,
+				   unsigned int port);
+extern int __fblock_unbind_from_port(struct fblock *fb1, struct fblock *fb2,
+				     unsigned int port);
 
 /* Lookup idp by fblock name. */
 extern idp_t get_fblock_namespace_mapping(char *name);
@@ -209,29 +401,12 @@ static inline void init_fblock_subscriber(struct fblock *fb,
 	nb->next = NULL;
 }
 
-static inline int
-fblock_register_foreign_subscriber(struct fblock *us,
-				   struct notifier_block *remote)
-{
-	return atomic_notifier_chain_register(&rcu_dereference_raw(us->others)->subscribers,
-					      remote);
-}
-
-static inline void
-fblock_unregister_foreign_subscriber(struct fblock *us,
-				     struct notifier_block *remote)
-{
-	atomic_notifier_chain_unregister(&rcu_dereference_raw(us->others)->subscribers,
-					 remote);
-}
+/* Queues cmd for the subscribers of us, see struct fblock_subscrib. */
+extern int notify_fblock_subscribers(struct fblock *us, unsigned long cmd);
 
-static inline int notify_fblock_subscribers(struct fblock *us,
-					    unsigned long cmd, void *arg)
+static inline int init_fblock(struct fblock *fb, char *name, void *priv)
 {
-	if (unlikely(!rcu_dereference_raw(us->others)))
-		return -ENOENT;
-	return atomic_notifier_call_chain(&rcu_dereference_raw(us->others)->subscribers,
-					  cmd, arg);
+	return init_fblock_ports(fb, name, priv, NUM_TYPES);
 }
 
 extern int init_fblock_tables(void);
@@ -241,9 +416,9 @@ extern void cleanup_fblock_tables(void);
 static inline void fblock_over_panic(struct fblock *fb, void *here)
 {
 	printk(KERN_EMERG "fblock_over_panic: text:%p ptr:%p idp:%u refs:%d "
-			  "name:%s priv:%p fac:%p not:%p others: %p\n",
+			  "name:%s priv:%p fac:%p others: %p\n",
 	       here, fb, fb->idp, atomic_read(&fb->refcnt), fb->name, 
-	       fb->private_data, fb->factory, fb->notifiers, fb->others);
+	       fb->private_data, fb->factory, fb->others);
 	BUG();
 }
 
@@ -0,0 +1,282 @@
+/*
+ * Lightweight Autonomic Network Architecture
+ *
+ * In-stack latency measurement. Skbs get stamped where they enter the
+ * graph and the delay is recorded where they leave it, into per-CPU
+ * log2 histograms per chain. A chain is identified by its ingress fblock.
+ *
+ * Copyright 2011 Daniel Borkmann <dborkma@tik.ee.ethz.ch>,
+ * Swiss federal institute of technology (ETH Zurich)
+ * Subject to the GPL.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>
+#include <linux/interrupt.h>
+#include <linux/bitops.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+
+#include "xt_latency.h"
+#include "xt_fblock.h"
+
+extern struct proc_dir_entry *lana_proc_dir;
+
+#define LAT_SLOTS_BITS	6
+#define LAT_SLOTS	(1 << LAT_SLOTS_BITS)
+#define LAT_PROBES	4
+/* Bucket b holds delays in [2^(b-1), 2^b) ns, the last one all above */
+#define LAT_BUCKETS	40
+
+struct latency_chain {
+	idp_t idp;
+	u64 samples;
+	u64 bucket[LAT_BUCKETS];
+};
+
+struct latency_table {
+	struct latency_chain chain[LAT_SLOTS];
+	u64 overflows;
+};
+
+static struct latency_table __percpu *lat_tables;
+static struct proc_dir_entry *latency_proc;
+
+struct jump_label_key lana_latency_key;
+EXPORT_SYMBOL_GPL(lana_latency_key);
+
+static bool lana_latency __read_mostly = false;
+static DEFINE_MUTEX(lana_latency_mutex);
+
+static int lana_latency_set(const char *val, const struct kernel_param *kp)
+{
+	int ret;
+	bool old;
+
+	mutex_lock(&lana_latency_mutex);
+	old = lana_latency;
+	ret = param_set_bool(val, kp);
+	if (!ret && lana_latency != old) {
+		if (lana_latency)
+			jump_label_inc(&lana_latency_key);
+		else
+			jump_label_dec(&lana_latency_key);
+	}
+	mutex_unlock(&lana_latency_mutex);
+
+	return ret;
+}
+
+static struct kernel_param_ops lana_latency_ops = {
+	.set = lana_latency_set,
+	.get = param_get_bool,
+};
+
+module_param_cb(ppe_latency, &lana_latency_ops, &lana_latency, 0644);
+MODULE_PARM_DESC(ppe_latency, "In-stack latency histograms");
+
+static inline unsigned int latency_bucket(u64 delta)
+{
+	return min_t(unsigned int, fls64(delta), LAT_BUCKETS - 1);
+}
+
+static struct latency_chain *latency_chain_get(struct latency_table *tab,
+					       idp_t idp)
+{
+	unsigned int i, slot = hash_32(idp, LAT_SLOTS_BITS);
+	struct latency_chain *chain;
+
+	for (i = 0; i < LAT_PROBES; ++i) {
+		chain = &tab->chain[(slot + i) & (LAT_SLOTS - 1)];
+		if (chain->idp == idp)
+			return chain;
+		if (chain->idp == IDP_UNKNOWN) {
+			chain->idp = idp;
+			return chain;
+		}
+	}
+
+	return NULL;
+}
+
+void __latency_record(struct sk_buff *skb)
+{
+	s64 delta;
+	struct latency_table *tab;
+	struct latency_chain *chain;
+
+	time_mark_skb_last(skb);
+	delta = (s64) (local_clock() - read_tstamp_from_skb(skb));
+	/* Clocks of different CPUs may be slightly off */
+	if (delta < 0)
+		delta = 0;
+
+	/* Process context senders must not race with softirqs */
+	local_bh_disable();
+	tab = this_cpu_ptr(lat_tables);
+	chain = latency_chain_get(tab, read_ingress_idp_from_skb(skb));
+	if (likely(chain)) {
+		chain->samples++;
+		chain->bucket[latency_bucket(delta)]++;
+	} else {
+		tab->overflows++;
+	}
+	local_bh_enable();
+}
+EXPORT_SYMBOL_GPL(__latency_record);
+
+/*
+ * Drops the chain of ingress block idp on all CPUs before the idp gets
+ * handed out again, so that its samples do not end up with an unrelated
+ * block. Entries probed past the freed slot may get a second one, they
+ * are merged on read anyway. Samples still in flight may race with this,
+ * which only costs some of them.
+ */
+void latency_forget(idp_t idp)
+{
+	unsigned int cpu, i, slot = hash_32(idp, LAT_SLOTS_BITS);
+	struct latency_table *tab;
+	struct latency_chain *chain;
+
+	for_each_possible_cpu(cpu) {
+		tab = per_cpu_ptr(lat_tables, cpu);
+		for (i = 0; i < LAT_PROBES; ++i) {
+			chain = &tab->chain[(slot + i) & (LAT_SLOTS - 1)];
+			if (chain->idp != idp)
+				continue;
+			memset(chain, 0, sizeof(*chain));
+			chain->idp = IDP_UNKNOWN;
+			break;
+		}
+	}
+}
+EXPORT_SYMBOL_GPL(latency_forget);
+
+/* Returns the estimated delay in ns below which q/1000 of samples are. */
+static u64 latency_percentile(struct latency_chain *chain, unsigned int q)
+{
+	unsigned int b;
+	u64 rank, cum = 0, lo, hi;
+
+	if (!chain->samples)
+		return 0;
+	rank = div_u64(chain->samples * q + 999, 1000);
+
+	for (b = 0; b < LAT_BUCKETS; ++b) {
+		if (cum + chain->bucket[b] >= rank)
+			break;
+		cum += chain->bucket[b];
+	}
+	if (b == 0)
+		return 0;
+	if (b == LAT_BUCKETS)
+		b = LAT_BUCKETS - 1;
+
+	/* Interpolate linearly within the bucket */
+	lo = 1ULL << (b - 1);
+	hi = 1ULL << b;
+	return lo + div64_u64((hi - lo) * (rank - cum), chain->bucket[b]);
+}
+
+static int latency_proc_show(struct seq_file *m, void *v)
+{
+	unsigned int cpu, i, j, b, num = 0;
+	u64 overflows = 0;
+	struct fblock *fb;
+	struct latency_table *tab;
+	struct latency_chain *sum, *chain;
+
+	sum = kzalloc(sizeof(*sum) * LAT_SLOTS, GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	/* Merge all per-CPU tables by chain */
+	for_each_possible_cpu(cpu) {
+		tab = per_cpu_ptr(lat_tables, cpu);
+		overflows += tab->overflows;
+		for (i = 0; i < LAT_SLOTS; ++i) {
+			chain = &tab->chain[i];
+			if (chain->idp == IDP_UNKNOWN)
+				continue;
+			for (j = 0; j < num; ++j)
+				if (sum[j].idp == chain->idp)
+					break;
+			if (j == num) {
+				if (num == LAT_SLOTS)
+					continue;
+				sum[num++].idp = chain->idp;
+			}
+			sum[j].samples += chain->samples;
+			for (b = 0; b < LAT_BUCKETS; ++b)
+				sum[j].bucket[b] += chain->bucket[b];
+		}
+	}
+
+	seq_puts(m, "name idp samples p50 p99 p99.9 (ns)\n");
+	rcu_read_lock();
+	for (j = 0; j < num; ++j) {
+		fb = fblock_table_lookup(sum[j].idp);
+		seq_printf(m, "%s %u %llu %llu %llu %llu\n",
+			   fb ? fb->name : "-", sum[j].idp, sum[j].samples,
+			   latency_percentile(&sum[j], 500),
+			   latency_percentile(&sum[j], 990),
+			   latency_percentile(&sum[j], 999));
+	}
+	rcu_read_unlock();
+	if (overflows)
+		seq_printf(m, "overflows %llu\n", overflows);
+
+	kfree(sum);
+
+	return 0;
+}
+
+static int latency_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, latency_proc_show, NULL);
+}
+
+static const struct file_operations latency_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = latency_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int init_latency(void)
+{
+	unsigned int cpu, i;
+
+	lat_tables = alloc_percpu(struct latency_table);
+	if (!lat_tables)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct latency_table *tab = per_cpu_ptr(lat_tables, cpu);
+		for (i = 0; i < LAT_SLOTS; ++i)
+			tab->chain[i].idp = IDP_UNKNOWN;
+	}
+
+	latency_proc = proc_create("latency", 0400, lana_proc_dir,
+				   &latency_proc_fops);
+	if (!latency_proc) {
+		free_percpu(lat_tables);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(init_latency);
+
+void cleanup_latency(void)
+{
+	remove_proc_entry("latency", lana_proc_dir);
+	free_percpu(lat_tables);
+}
+EXPORT_SYMBOL_GPL(cleanup_latency);
@@ -0,0 +1,47 @@
+/*
+ * Lightweight Autonomic Network Architecture
+ *
+ * Copyright 2011 Daniel Borkmann <dborkma@tik.ee.ethz.ch>,
+ * Swiss federal institute of technology (ETH Zurich)
+ * Subject to the GPL.
+ */
+
+#ifndef XT_LATENCY_H
+#define XT_LATENCY_H
+
+#include <linux/skbuff.h>
+#include <linux/jump_label.h>
+
+#include "xt_idp.h"
+#include "xt_skb.h"
+
+extern struct jump_label_key lana_latency_key;
+
+extern void __latency_record(struct sk_buff *skb);
+extern void latency_forget(idp_t idp);
+
+/*
+ * Called where skbs enter the graph. idp is the ingress fblock that
+ * identifies the chain. Markers are reset in any case, since the control
+ * buffer may contain garbage from layers below.
+ */
+static inline void latency_mark_ingress(struct sk_buff *skb, idp_t idp)
+{
+	if (static_branch(&lana_latency_key))
+		time_mark_skb_first(skb, idp);
+	else
+		time_unmark_skb(skb);
+}
+
+/* Called where skbs leave the graph, records the in-stack delay. */
+static inline void latency_mark_egress(struct sk_buff *skb)
+{
+	if (static_branch(&lana_latency_key) &&
+	    skb_is_time_marked_first(skb) && !skb_is_time_marked_last(skb))
+		__latency_record(skb);
+}
+
+extern int init_latency(void);
+extern void cleanup_latency(void);
+
+#endif /* XT_LATENCY_H */
@@ -10,6 +10,7 @@
 #define XT_SKB_H
 
 #include <linux/skbuff.h>
+#include <linux/sched.h>
 #include "xt_idp.h"
 
 #define MARKER_TIME_MARKED_FIRST	(1 << 0)
@@ -22,6 +23,9 @@ struct sock_lana_inf {
 	__u32		errno;
 	__u32		marker;
 	enum path_type	dir;
+	idp_t		idp_in;
+	__u16		hop;
+	__u64		tstamp;
 };
 
 #define SKB_LANA_INF(skb) ((struct sock_lana_inf *) ((skb)->cb))
@@ -52,6 +56,19 @@ static inline enum path_type read_path_from_skb(struct sk_buff *skb)
 	return SKB_LANA_INF(skb)->dir;
 }
 
+/* Starts a new path at the fblock that handed skb to the engine. */
+static inline void write_path_start_to_skb(struct sk_buff *skb)
+{
+	struct sock_lana_inf *sli = SKB_LANA_INF(skb);
+	sli->idp_in = sli->idp_src;
+	sli->hop = 0;
+}
+
+static inline void write_next_hop_to_skb(struct sk_buff *skb)
+{
+	SKB_LANA_INF(skb)->hop++;
+}
+
 static inline void time_mark_skb_last(struct sk_buff *skb)
 {
 	struct sock_lana_inf *sli = SKB_LANA_INF(skb);
@@ -64,10 +81,28 @@ static inline int skb_is_time_marked_last(struct sk_buff *skb)
 		MARKER_TIME_MARKED_LAST) == MARKER_TIME_MARKED_LAST;
 }
 
-static inline void time_mark_skb_first(struct sk_buff *skb)
+/* Stamps skb with the time it entered the graph at ingress idp. */
+static inline void time_mark_skb_first(struct sk_buff *skb, idp_t idp)
 {
 	struct sock_lana_inf *sli = SKB_LANA_INF(skb);
-	sli->marker |= MARKER_TIME_MARKED_FIRST;
+	sli->marker = MARKER_TIME_MARKED_FIRST;
+	sli->idp_in = idp;
+	sli->tstamp = local_clock();
+}
+
+static inline void time_unmark_skb(struct sk_buff *skb)
+{
+	SKB_LANA_INF(skb)->marker = 0;
+}
+
+static inline idp_t read_ingress_idp_from_skb(struct sk_buff *skb)
+{
+	return SKB_LANA_INF(skb)->idp_in;
+}
+
+static inline u64 read_tstamp_from_skb(struct sk_buff *skb)
+{
+	return SKB_LANA_INF(skb)->tstamp;
 }
 
 static inline int skb_is_time_marked_first(struct sk_buff *skb)
@@ -15,6 +15,10 @@
 #include <linux/net.h>
 #include <linux/skbuff.h>
 #include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/dcache.h>
+#include <linux/log2.h>
 #include <net/netlink.h>
 #include <net/sock.h>
 
@@ -22,9 +26,13 @@
 #include "xt_user.h"
 #include "xt_fblock.h"
 #include "xt_builder.h"
+#include "xt_engine.h"
 
 static struct sock *userctl_sock = NULL;
 
+/* Serializes all reconfigurations, single ones and transactions */
+static DEFINE_MUTEX(userctl_mutex);
+
 static int userctl_add(struct lananlmsg *lmsg)
 {
 	struct fblock *fb;
@@ -91,14 +99,22 @@ static int userctl_replace(struct lananlmsg *lmsg)
 
 	unregister_fblock_namespace_no_rcu(fb2);
 
-	if (!strncmp(fb1->factory->type, fb2->factory->type,
-		     sizeof(fb1->factory->type)) && !msg->drop_priv)
-		fblock_migrate_p(fb2, fb1);
-	fblock_migrate_r(fb2, fb1);
-
-	unregister_fblock(fb1);
-
-	ret = register_fblock(fb2, fb2->idp);
+	ret = fblock_replace(fb2, fb1, !strncmp(fb1->factory->type,
+						fb2->factory->type,
+						sizeof(fb1->factory->type)) &&
+				       !msg->drop_priv);
+	if (ret) {
+		/*
+		 * fb1 is gone meanwhile or fb2 could not take over, so fb2
+		 * gets its own idp back. If that fails, it is neither in the
+		 * table nor named, so its registration can be dropped.
+		 */
+		if (register_fblock_namespace(fb2)) {
+			printk(KERN_ERR "[lana] Cannot reregister %s!\n",
+			       fb2->name);
+			put_fblock(fb2);
+		}
+	}
 
 	put_fblock(fb1);
 	put_fblock(fb2);
@@ -230,6 +246,462 @@ static int userctl_unbind(struct lananlmsg *lmsg)
 	return ret;
 }
 
+static int userctl_bind_port(struct lananlmsg *lmsg, int bind)
+{
+	int ret;
+	struct fblock *fb1, *fb2;
+	struct lananlmsg_port *msg = (struct lananlmsg_port *) lmsg->buff;
+
+	fb1 = search_fblock_n(msg->name1);
+	if (!fb1)
+		return -EINVAL;
+
+	fb2 = search_fblock_n(msg->name2);
+	if (!fb2) {
+		put_fblock(fb1);
+		return -EINVAL;
+	}
+
+	if (bind)
+		ret = fblock_bind_to_port(fb1, fb2, msg->port);
+	else
+		ret = fblock_unbind_from_port(fb1, fb2, msg->port);
+
+	put_fblock(fb1);
+	put_fblock(fb2);
+
+	return ret;
+}
+
+/* Sends the first len bytes of lmsg back to the requester. */
+static int userctl_reply(struct lananlmsg *lmsg, size_t len,
+			 struct nlmsghdr *nlh, u32 pid)
+{
+	struct sk_buff *rskb;
+	struct nlmsghdr *rnlh;
+
+	rskb = nlmsg_new(len, GFP_KERNEL);
+	if (!rskb)
+		return -ENOMEM;
+	rnlh = nlmsg_put(rskb, pid, nlh->nlmsg_seq, nlh->nlmsg_type, len, 0);
+	if (!rnlh) {
+		kfree_skb(rskb);
+		return -EMSGSIZE;
+	}
+
+	memcpy(nlmsg_data(rnlh), lmsg, len);
+
+	return netlink_unicast(userctl_sock, rskb, pid, MSG_DONTWAIT) < 0 ?
+	       -ENOBUFS : 0;
+}
+
+static int userctl_stats(struct lananlmsg *lmsg, struct nlmsghdr *nlh,
+			 u32 pid)
+{
+	struct fblock *fb;
+	struct fblock_stats sum;
+	struct lananlmsg_stats *msg;
+
+	msg = (struct lananlmsg_stats *) lmsg->buff;
+	fb = search_fblock_n(msg->name);
+	if (!fb)
+		return -EINVAL;
+
+	fblock_stats_sum(fb, &sum);
+	msg->idp = fb->idp;
+	msg->pkts = sum.pkts;
+	msg->bytes = sum.bytes;
+	msg->drops = sum.drops;
+	msg->cycles = sum.cycles;
+
+	put_fblock(fb);
+
+	return userctl_reply(lmsg, sizeof(*lmsg), nlh, pid);
+}
+
+static int userctl_op_check_syntax(struct lananlmsg_op *op)
+{
+	if (!memchr(op->name1, 0, sizeof(op->name1)) ||
+	    !memchr(op->name2, 0, sizeof(op->name2)) ||
+	    !memchr(op->arg, 0, sizeof(op->arg)) || !op->name1[0])
+		return -EINVAL;
+
+	switch (op->cmd) {
+	case NETLINK_USERCTL_CMD_ADD:
+	case NETLINK_USERCTL_CMD_SET:
+		return op->arg[0] ? 0 : -EINVAL;
+	case NETLINK_USERCTL_CMD_RM:
+		return 0;
+	case NETLINK_USERCTL_CMD_BIND:
+	case NETLINK_USERCTL_CMD_UNBIND:
+	case NETLINK_USERCTL_CMD_BIND_PORT:
+	case NETLINK_USERCTL_CMD_UNBIND_PORT:
+		return op->name2[0] ? 0 : -EINVAL;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/* Names a transaction adds, hashed for its validation */
+struct userctl_names {
+	unsigned int mask;
+	struct hlist_head *head;
+	struct hlist_node *node;
+};
+
+static struct hlist_head *userctl_names_bucket(struct userctl_names *names,
+					       char *name)
+{
+	return &names->head[full_name_hash(name, strlen(name)) & names->mask];
+}
+
+static int userctl_names_init(struct userctl_names *names, unsigned int num)
+{
+	unsigned int size = roundup_pow_of_two(num ? : 1);
+
+	names->mask = size - 1;
+	names->head = kcalloc(size, sizeof(*names->head), GFP_KERNEL);
+	names->node = kcalloc(num ? : 1, sizeof(*names->node), GFP_KERNEL);
+	if (!names->head || !names->node) {
+		kfree(names->head);
+		kfree(names->node);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void userctl_names_free(struct userctl_names *names)
+{
+	kfree(names->head);
+	kfree(names->node);
+}
+
+/* Whether name exists before ops[i] runs, ops before it being applied */
+static int userctl_name_exists(struct userctl_names *names,
+			       struct lananlmsg_op *ops, char *name)
+{
+	struct hlist_node *pos;
+
+	if (get_fblock_namespace_mapping(name) != IDP_UNKNOWN)
+		return 1;
+	hlist_for_each(pos, userctl_names_bucket(names, name))
+		if (!strcmp(ops[pos - names->node].name1, name))
+			return 1;
+	return 0;
+}
+
+/*
+ * Checks ops[i] against the graph as it will be when ops[i] runs. Set and
+ * rm cannot be undone, hence they are only allowed as the last operation,
+ * when nothing can fail after them anymore.
+ */
+static int userctl_op_check(struct lananlmsg_op *ops, int i, int num,
+			    struct userctl_names *names)
+{
+	int ret;
+	struct lananlmsg_op *op = &ops[i];
+
+	ret = userctl_op_check_syntax(op);
+	if (ret)
+		return ret;
+
+	switch (op->cmd) {
+	case NETLINK_USERCTL_CMD_ADD:
+		if (userctl_name_exists(names, ops, op->name1))
+			return -EEXIST;
+		if (!fblock_type_registered(op->arg))
+			return -ENOENT;
+		hlist_add_head(&names->node[i],
+			       userctl_names_bucket(names, op->name1));
+		return 0;
+	case NETLINK_USERCTL_CMD_SET:
+	case NETLINK_USERCTL_CMD_RM:
+		if (i != num - 1)
+			return -EINVAL;
+		break;
+	default:
+		if (!userctl_name_exists(names, ops, op->name2))
+			return -ENOENT;
+		break;
+	}
+
+	return userctl_name_exists(names, ops, op->name1) ? 0 : -ENOENT;
+}
+
+/* Returns the command that undoes cmd, 0 if there is none. */
+static uint32_t userctl_op_undo(uint32_t cmd)
+{
+	switch (cmd) {
+	case NETLINK_USERCTL_CMD_ADD:
+		return NETLINK_USERCTL_CMD_RM;
+	case NETLINK_USERCTL_CMD_BIND:
+		return NETLINK_USERCTL_CMD_UNBIND;
+	case NETLINK_USERCTL_CMD_UNBIND:
+		return NETLINK_USERCTL_CMD_BIND;
+	case NETLINK_USERCTL_CMD_BIND_PORT:
+		return NETLINK_USERCTL_CMD_UNBIND_PORT;
+	case NETLINK_USERCTL_CMD_UNBIND_PORT:
+		return NETLINK_USERCTL_CMD_BIND_PORT;
+	default:
+		return 0;
+	}
+}
+
+/* Runs cmd with the arguments of op, lmsg is scratch space. */
+static int userctl_op_run(struct lananlmsg_op *op, uint32_t cmd,
+			  struct lananlmsg *lmsg)
+{
+	memset(lmsg, 0, sizeof(*lmsg));
+	lmsg->cmd = cmd;
+
+	switch (cmd) {
+	case NETLINK_USERCTL_CMD_ADD: {
+		struct lananlmsg_add *msg = (struct lananlmsg_add *) lmsg->buff;
+		strlcpy(msg->name, op->name1, sizeof(msg->name));
+		strlcpy(msg->type, op->arg, sizeof(msg->type));
+		return userctl_add(lmsg);
+		}
+	case NETLINK_USERCTL_CMD_SET: {
+		struct lananlmsg_set *msg = (struct lananlmsg_set *) lmsg->buff;
+		strlcpy(msg->name, op->name1, sizeof(msg->name));
+		strlcpy(msg->option, op->arg, sizeof(msg->option));
+		return userctl_set(lmsg);
+		}
+	case NETLINK_USERCTL_CMD_RM: {
+		struct lananlmsg_rm *msg = (struct lananlmsg_rm *) lmsg->buff;
+		strlcpy(msg->name, op->name1, sizeof(msg->name));
+		return userctl_remove(lmsg);
+		}
+	case NETLINK_USERCTL_CMD_BIND:
+	case NETLINK_USERCTL_CMD_UNBIND: {
+		struct lananlmsg_tuple *msg = (struct lananlmsg_tuple *) lmsg->buff;
+		strlcpy(msg->name1, op->name1, sizeof(msg->name1));
+		strlcpy(msg->name2, op->name2, sizeof(msg->name2));
+		return cmd == NETLINK_USERCTL_CMD_BIND ? userctl_bind(lmsg) :
+							 userctl_unbind(lmsg);
+		}
+	case NETLINK_USERCTL_CMD_BIND_PORT:
+	case NETLINK_USERCTL_CMD_UNBIND_PORT: {
+		struct lananlmsg_port *msg = (struct lananlmsg_port *) lmsg->buff;
+		strlcpy(msg->name1, op->name1, sizeof(msg->name1));
+		strlcpy(msg->name2, op->name2, sizeof(msg->name2));
+		msg->port = op->port;
+		return userctl_bind_port(lmsg, cmd == NETLINK_USERCTL_CMD_BIND_PORT);
+		}
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/*
+ * Applies a list of operations as a whole. All of them are checked
+ * against the graph first, then applied in order. If one fails, the ones
+ * before it are undone in reverse order. Since set and rm cannot be
+ * undone, only the last operation may be one of them. Operations that
+ * were not applied or were undone get -ECANCELED. The status is always
+ * sent back, the return value only tells whether that worked. Each
+ * operation is published on its own, readers may see the ones in between.
+ */
+static int userctl_commit(struct lananlmsg *lmsg, struct nlmsghdr *nlh,
+			  u32 pid)
+{
+	int i, j, num;
+	uint32_t undo;
+	size_t len = nlmsg_len(nlh);
+	struct lananlmsg *scratch;
+	struct userctl_names names;
+	struct lananlmsg_trans *trans = (struct lananlmsg_trans *) lmsg->buff;
+
+	if (trans->num > USERCTL_TRANS_MAX ||
+	    len < offsetof(struct lananlmsg, buff) + sizeof(*trans) +
+		  trans->num * sizeof(trans->op[0]))
+		return -EINVAL;
+	num = trans->num;
+
+	scratch = kmalloc(sizeof(*scratch), GFP_KERNEL);
+	if (!scratch)
+		return -ENOMEM;
+	if (userctl_names_init(&names, num)) {
+		kfree(scratch);
+		return -ENOMEM;
+	}
+
+	trans->failed = -1;
+	for (i = 0; i < num; ++i) {
+		trans->op[i].status = userctl_op_check(trans->op, i, num,
+						       &names);
+		if (trans->op[i].status && trans->failed < 0)
+			trans->failed = i;
+	}
+	userctl_names_free(&names);
+	if (trans->failed >= 0) {
+		for (i = 0; i < num; ++i)
+			if (!trans->op[i].status)
+				trans->op[i].status = -ECANCELED;
+		goto out;
+	}
+
+	for (i = 0; i < num; ++i) {
+		trans->op[i].status = userctl_op_run(&trans->op[i],
+						     trans->op[i].cmd, scratch);
+		if (trans->op[i].status) {
+			trans->failed = i;
+			break;
+		}
+	}
+	if (trans->failed < 0)
+		goto out;
+
+	for (j = i - 1; j >= 0; --j) {
+		undo = userctl_op_undo(trans->op[j].cmd);
+		if (undo && !userctl_op_run(&trans->op[j], undo, scratch))
+			trans->op[j].status = -ECANCELED;
+	}
+	for (j = i + 1; j < num; ++j)
+		trans->op[j].status = -ECANCELED;
+out:
+	kfree(scratch);
+	return userctl_reply(lmsg, len, nlh, pid);
+}
+
+/* Dump cursor is cb->args[0] for the stage, cb->args[1] for the idp or cpu */
+enum {
+	USERCTL_DUMP_STAGE_FBLOCKS = 0,
+	USERCTL_DUMP_STAGE_ENGINE,
+	USERCTL_DUMP_STAGE_DONE,
+};
+
+static int userctl_dump_fblock(struct sk_buff *skb, struct netlink_callback *cb,
+			       struct fblock *fb)
+{
+	size_t len;
+	unsigned int i, num_ports, num_subs, subs = 0;
+	struct nlmsghdr *nlh;
+	struct fblock_stats sum;
+	struct fblock_ports *ports;
+	struct fblock_notifier *fn;
+	struct fblock_subscrib *others;
+	struct lananlmsg_dump_fblock *rec;
+
+	ports = rcu_dereference(fb->ports);
+	num_ports = ports ? ports->num : 0;
+	others = rcu_dereference(fb->others);
+	if (others)
+		list_for_each_entry_rcu(fn, &others->subscriptions, own_list)
+			subs++;
+	num_subs = min_t(unsigned int, subs, USERCTL_DUMP_SUBS_MAX);
+
+	len = sizeof(*rec) + (num_ports + num_subs) * sizeof(rec->idps[0]);
+	nlh = nlmsg_put(skb, NETLINK_CB(cb->skb).pid, cb->nlh->nlmsg_seq,
+			USERCTL_DUMP_FBLOCK, len, NLM_F_MULTI);
+	if (!nlh)
+		return -EMSGSIZE;
+
+	rec = nlmsg_data(nlh);
+	memset(rec, 0, len);
+	strlcpy(rec->name, fb->name, sizeof(rec->name));
+	strlcpy(rec->type, fb->factory ? fb->factory->type : "vlink",
+		sizeof(rec->type));
+	rec->idp = fb->idp;
+	rec->refcnt = atomic_read(&fb->refcnt);
+	rec->num_ports = num_ports;
+	rec->subs = subs;
+	for (i = 0; i < num_ports; ++i)
+		rec->idps[i] = ports->port[i];
+
+	i = 0;
+	if (others) {
+		list_for_each_entry_rcu(fn, &others->subscriptions, own_list) {
+			/* The list may have grown meanwhile */
+			if (i == num_subs)
+				break;
+			rec->idps[num_ports + i++] = fn->remote;
+		}
+	}
+	rec->num_subs = i;
+
+	fblock_stats_sum(fb, &sum);
+	rec->pkts = sum.pkts;
+	rec->bytes = sum.bytes;
+	rec->drops = sum.drops;
+	rec->cycles = sum.cycles;
+
+	return 0;
+}
+
+static int userctl_dump_engine(struct sk_buff *skb, struct netlink_callback *cb,
+			       unsigned int cpu)
+{
+	struct nlmsghdr *nlh;
+	struct engine_iostats stats;
+	struct lananlmsg_dump_engine *rec;
+
+	nlh = nlmsg_put(skb, NETLINK_CB(cb->skb).pid, cb->nlh->nlmsg_seq,
+			USERCTL_DUMP_ENGINE, sizeof(*rec), NLM_F_MULTI);
+	if (!nlh)
+		return -EMSGSIZE;
+
+	rec = nlmsg_data(nlh);
+	memset(rec, 0, sizeof(*rec));
+	rec->cpu = cpu;
+	engine_cpu_stats(cpu, &stats, &rec->backlog, &rec->hiwat);
+	rec->pkts = stats.pkts;
+	rec->bytes = stats.bytes;
+	rec->fblocks = stats.fblocks;
+	rec->sched = stats.sched;
+	rec->resched = stats.resched;
+	rec->drops = stats.drops;
+	rec->steals = stats.steals;
+	rec->hits = stats.hits;
+	rec->lost = stats.lost;
+
+	return 0;
+}
+
+/*
+ * Fills skb with as many records as fit and returns its length, netlink
+ * calls us again with the same cb until that is 0. fblocks are walked by
+ * idp, so the cursor stays valid while the table is resized and blocks
+ * come and go in between, those just may or may not show up.
+ */
+static int userctl_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	unsigned int cpu;
+	struct fblock *fb;
+	struct fblock_table *tab;
+
+	if (cb->args[0] == USERCTL_DUMP_STAGE_FBLOCKS) {
+		rcu_read_lock();
+		tab = rcu_dereference(fbltab);
+		for (; cb->args[1] < tab->size; cb->args[1]++) {
+			fb = __fblock_table_lookup(tab, cb->args[1]);
+			if (!fb)
+				continue;
+			if (userctl_dump_fblock(skb, cb, fb)) {
+				rcu_read_unlock();
+				return skb->len;
+			}
+		}
+		rcu_read_unlock();
+		cb->args[0] = USERCTL_DUMP_STAGE_ENGINE;
+		cb->args[1] = 0;
+	}
+
+	if (cb->args[0] == USERCTL_DUMP_STAGE_ENGINE) {
+		for (cpu = cb->args[1]; cpu < nr_cpu_ids; ++cpu) {
+			if (!cpu_possible(cpu))
+				continue;
+			if (userctl_dump_engine(skb, cb, cpu)) {
+				cb->args[1] = cpu;
+				return skb->len;
+			}
+		}
+		cb->args[0] = USERCTL_DUMP_STAGE_DONE;
+	}
+
+	return skb->len;
+}
+
 static int __userctl_rcv(struct sk_buff *skb, struct nlmsghdr *nlh)
 {
 	int ret = 0;
@@ -242,6 +714,15 @@ static int __userctl_rcv(struct sk_buff *skb, struct nlmsghdr *nlh)
 
 	lmsg = NLMSG_DATA(nlh);
 
+	/* Dumps run lockless under RCU, netlink calls back into them */
+	if (lmsg->cmd == NETLINK_USERCTL_CMD_DUMP) {
+		if (!(nlh->nlmsg_flags & NLM_F_DUMP))
+			return -EINVAL;
+		return netlink_dump_start(userctl_sock, skb, nlh, userctl_dump,
+					  NULL, 0);
+	}
+
+	mutex_lock(&userctl_mutex);
 	switch (lmsg->cmd) {
 	case NETLINK_USERCTL_CMD_ADD:
 		ret = userctl_add(lmsg);
@@ -267,11 +748,24 @@ static int __userctl_rcv(struct sk_buff *skb, struct nlmsghdr *nlh)
 	case NETLINK_USERCTL_CMD_UNBIND:
 		ret = userctl_unbind(lmsg);
 		break;
+	case NETLINK_USERCTL_CMD_BIND_PORT:
+		ret = userctl_bind_port(lmsg, 1);
+		break;
+	case NETLINK_USERCTL_CMD_UNBIND_PORT:
+		ret = userctl_bind_port(lmsg, 0);
+		break;
+	case NETLINK_USERCTL_CMD_STATS:
+		ret = userctl_stats(lmsg, nlh, NETLINK_CB(skb).pid);
+		break;
+	case NETLINK_USERCTL_CMD_COMMIT:
+		ret = userctl_commit(lmsg, nlh, NETLINK_CB(skb).pid);
+		break;
 	default:
 		printk(KERN_INFO "[lana] Unknown command!\n");
 		ret = -ENOENT;
 		break;
 	}
+	mutex_unlock(&userctl_mutex);
 
 	return ret;
 }
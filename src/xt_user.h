@@ -10,6 +10,7 @@
 #define XT_USER_H
 
 #include <linux/types.h>
+#include <linux/netlink.h>
 
 #include "xt_vlink.h"
 #include "xt_fblock.h"
@@ -35,6 +36,22 @@ enum userctl_groups {
 #define NETLINK_USERCTL_CMD_REPLACE	6
 #define NETLINK_USERCTL_CMD_SUBSCRIBE	7
 #define NETLINK_USERCTL_CMD_UNSUBSCRIBE	8
+#define NETLINK_USERCTL_CMD_STATS	9
+#define NETLINK_USERCTL_CMD_BIND_PORT	10
+#define NETLINK_USERCTL_CMD_UNBIND_PORT	11
+#define NETLINK_USERCTL_CMD_COMMIT	12
+#define NETLINK_USERCTL_CMD_DUMP	13
+
+/* nlmsg_type of the records of a dump */
+#define USERCTL_DUMP_FBLOCK	(NLMSG_MIN_TYPE + 0)
+#define USERCTL_DUMP_ENGINE	(NLMSG_MIN_TYPE + 1)
+
+/* Subscriptions listed per fblock record at most */
+#define USERCTL_DUMP_SUBS_MAX	256
+
+/* Max. number of operations in one transaction */
+#define USERCTL_TRANS_MAX	16384
+#define USERCTL_ARG_LEN		64
 
 struct lananlmsg_add {
 	char name[FBNAMSIZ];
@@ -56,12 +73,101 @@ struct lananlmsg_tuple {
 	char name2[FBNAMSIZ];
 };
 
+/* name2 on the given port of name1 */
+struct lananlmsg_port {
+	char name1[FBNAMSIZ];
+	char name2[FBNAMSIZ];
+	uint32_t port;
+};
+
 struct lananlmsg_replace {
 	char name1[FBNAMSIZ];
 	char name2[FBNAMSIZ];
 	uint8_t drop_priv;
 };
 
+/*
+ * One operation of a transaction, cmd is one of ADD, SET, RM, BIND,
+ * UNBIND, BIND_PORT or UNBIND_PORT. arg is the type for ADD and the
+ * option for SET. status is filled in by the kernel.
+ */
+struct lananlmsg_op {
+	uint32_t cmd;
+	int32_t status;
+	char name1[FBNAMSIZ];
+	char name2[FBNAMSIZ];
+	uint32_t port;
+	char arg[USERCTL_ARG_LEN];
+};
+
+/*
+ * Transaction header within lananlmsg's buff. The operations follow it
+ * and may go on past the end of struct lananlmsg, the netlink message
+ * length tells how far. The reply carries the whole message back with
+ * all status fields set and failed being the index of the operation that
+ * failed, or -1 if all were applied.
+ *
+ * A transaction is atomic towards other transactions and as to its
+ * outcome, but not towards the data path: operations are published one
+ * at a time, so packets may see the graph half way through it. If one
+ * fails, the ones before it are undone, which packets may see as well.
+ * SET and RM cannot be undone, so only the last operation may be one.
+ */
+struct lananlmsg_trans {
+	uint32_t num;
+	int32_t failed;
+	struct lananlmsg_op op[];
+};
+
+/* Request carries the name, the reply all of it */
+struct lananlmsg_stats {
+	char name[FBNAMSIZ];
+	uint32_t idp;
+	uint64_t pkts;
+	uint64_t bytes;
+	uint64_t drops;
+	uint64_t cycles;
+};
+
+/*
+ * Dump record of one fblock, followed by num_ports port idps and then
+ * num_subs idps of the fblocks it is subscribed to. num_subs is capped at
+ * USERCTL_DUMP_SUBS_MAX, subs is the real count. Counters need the lana
+ * module parameter ppe_fb_stats=1.
+ */
+struct lananlmsg_dump_fblock {
+	char name[FBNAMSIZ];
+	char type[TYPNAMSIZ];
+	uint32_t idp;
+	int32_t refcnt;
+	uint32_t num_ports;
+	uint32_t num_subs;
+	uint32_t subs;
+	uint32_t pad;
+	uint64_t pkts;
+	uint64_t bytes;
+	uint64_t drops;
+	uint64_t cycles;
+	uint32_t idps[];
+};
+
+/* Dump record of one CPU's packet processing engine */
+struct lananlmsg_dump_engine {
+	uint32_t cpu;
+	uint32_t backlog;
+	uint32_t hiwat;
+	uint32_t pad;
+	uint64_t pkts;
+	uint64_t bytes;
+	uint64_t fblocks;
+	uint64_t sched;
+	uint64_t resched;
+	uint64_t drops;
+	uint64_t steals;
+	uint64_t hits;
+	uint64_t lost;
+};
+
 extern int init_userctl_system(void);
 extern void cleanup_userctl_system(void);
 
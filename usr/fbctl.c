@@ -18,6 +18,8 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -117,10 +119,17 @@ static void usage(void)
 	printf("  rm <name>                    - remove fblock from stack if unbound\n");
 	printf("  bind <name1> <name2>         - bind two fblocks\n");
 	printf("  unbind <name1> <name2>       - unbind two fblocks\n");
+	printf("  bindport <name1> <name2> <port>\n");
+	printf("                               - bind fb2 to port of fb1\n");
+	printf("  unbindport <name1> <name2> <port>\n");
+	printf("                               - unbind fb2 from port of fb1\n");
 	printf("  replace <name1> <name2>      - exchange fb1 with fb2 (*)\n");
 	printf("  replace_drop <name1> <name2> - exchange fb1 with fb2 (*)\n");
 	printf("  subscribe <name1> <name2>    - subscribe fb2 to fb1 (+)\n");
 	printf("  unsubscribe <name1> <name2>  - unsubscribe fb2 from fb1 (+)\n");
+	printf("  stats <name>                 - show fblock statistics (#)\n");
+	printf("  commit <file>                - apply file of commands at once (~)\n");
+	printf("  dump                         - show all fblocks and engine stats\n");
 	printf("\n");
 	printf("Note (*):\n");
 	printf("  (*) 'replace' drops functional block <name1> and replaces\n");
@@ -132,6 +141,13 @@ static void usage(void)
 	printf("      'replace_drop' instead.\n");
 	printf("  (+) 'subscribe' is used to receive events from other\n");
 	printf("      functional blocks.\n");
+	printf("  (#) 'stats' needs the lana module parameter ppe_fb_stats=1.\n");
+	printf("  (~) 'commit' takes one add, set, rm, bind, unbind, bindport\n");
+	printf("      or unbindport command per line. All are checked first,\n");
+	printf("      if one fails, the ones before it are undone. set and rm\n");
+	printf("      cannot be undone, so only the last line may be one.\n");
+	printf("      Lines take effect one by one, so traffic may see the\n");
+	printf("      graph in between, or partly undone on failure.\n");
 	printf("\n");
 	printf("Please report bugs to <dborkma@tik.ee.ethz.ch>\n");
 	printf("Copyright (C) 2011 Daniel Borkmann\n");
@@ -203,16 +219,10 @@ static void do_preload(int argc, char **argv)
 		panic("Preload failed!\n");
 }
 
-static void send_netlink(struct lananlmsg *lmsg)
+static int open_netlink(int bufsiz)
 {
 	int sock, ret;
-	struct sockaddr_nl src_addr, dest_addr;
-	struct nlmsghdr *nlh;
-	struct iovec iov;
-	struct msghdr msg;
-
-	if (unlikely(!lmsg))
-		return;
+	struct sockaddr_nl src_addr;
 
 	sock = socket(PF_NETLINK, SOCK_RAW, NETLINK_USERCTL);
 	if (unlikely(sock < 0))
@@ -229,19 +239,47 @@ static void send_netlink(struct lananlmsg *lmsg)
 	if (unlikely(ret))
 		panic("Cannot bind socket!\n");
 
+	if (bufsiz) {
+		setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, &bufsiz,
+			   sizeof(bufsiz));
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &bufsiz,
+			   sizeof(bufsiz));
+	}
+
+	return sock;
+}
+
+/*
+ * Sends len bytes of lmsg. If reply is set, lmsg gets overwritten with the
+ * kernel's answer of the same length.
+ */
+static void __send_netlink(struct lananlmsg *lmsg, size_t len, int reply)
+{
+	int sock, ret;
+	struct sockaddr_nl dest_addr;
+	struct nlmsghdr *nlh;
+	struct iovec iov;
+	struct msghdr msg;
+
+	if (unlikely(!lmsg))
+		return;
+
+	/* Transactions may not fit into the default socket buffers */
+	sock = open_netlink(len > sizeof(*lmsg) ? 2 * NLMSG_SPACE(len) : 0);
+
 	memset(&dest_addr, 0, sizeof(dest_addr));
 	dest_addr.nl_family = AF_NETLINK;
 	dest_addr.nl_pad = 0;
 	dest_addr.nl_pid = 0;
 	dest_addr.nl_groups = 0;
 
-	nlh = xzmalloc(NLMSG_SPACE(sizeof(*lmsg)));
-	nlh->nlmsg_len = NLMSG_SPACE(sizeof(*lmsg));
+	nlh = xzmalloc(NLMSG_SPACE(len));
+	nlh->nlmsg_len = NLMSG_SPACE(len);
 	nlh->nlmsg_pid = getpid();
 	nlh->nlmsg_type = USERCTLGRP_CONF;
 	nlh->nlmsg_flags = NLM_F_REQUEST;
 
-	memcpy(NLMSG_DATA(nlh), lmsg, sizeof(*lmsg));
+	memcpy(NLMSG_DATA(nlh), lmsg, len);
 
 	iov.iov_base = nlh;
 	iov.iov_len = nlh->nlmsg_len;
@@ -256,10 +294,37 @@ static void send_netlink(struct lananlmsg *lmsg)
 	if (unlikely(ret < 0))
 		panic("Cannot send NETLINK message to the kernel!\n");
 
+	if (reply) {
+		memset(nlh, 0, NLMSG_SPACE(len));
+		iov.iov_base = nlh;
+		iov.iov_len = NLMSG_SPACE(len);
+
+		ret = recvmsg(sock, &msg, 0);
+		if (unlikely(ret < 0))
+			panic("Cannot receive NETLINK message from the "
+			      "kernel!\n");
+		if (!NLMSG_OK(nlh, (unsigned int) ret) ||
+		    nlh->nlmsg_type == NLMSG_ERROR ||
+		    nlh->nlmsg_len < NLMSG_LENGTH(len))
+			panic("Kernel refused request!\n");
+
+		memcpy(lmsg, NLMSG_DATA(nlh), len);
+	}
+
 	close(sock);
 	xfree(nlh);
 }
 
+static inline void send_netlink(struct lananlmsg *lmsg)
+{
+	__send_netlink(lmsg, sizeof(*lmsg), 0);
+}
+
+static inline void send_netlink_reply(struct lananlmsg *lmsg)
+{
+	__send_netlink(lmsg, sizeof(*lmsg), 1);
+}
+
 static void do_add(int argc, char **argv)
 {
 	struct lananlmsg lmsg;
@@ -339,6 +404,24 @@ static void do_unbind(int argc, char **argv)
 	send_netlink(&lmsg);
 }
 
+static void do_bind_port(int argc, char **argv, int bind)
+{
+	struct lananlmsg lmsg;
+	struct lananlmsg_port *msg;
+
+	if (argc != 3)
+		usage();
+
+	memset(&lmsg, 0, sizeof(lmsg));
+	lmsg.cmd = bind ? NETLINK_USERCTL_CMD_BIND_PORT :
+			  NETLINK_USERCTL_CMD_UNBIND_PORT;
+	msg = (struct lananlmsg_port *) lmsg.buff;
+	strlcpy(msg->name1, argv[0], sizeof(msg->name1));
+	strlcpy(msg->name2, argv[1], sizeof(msg->name2));
+	msg->port = (uint32_t) strtoul(argv[2], NULL, 10);
+	send_netlink(&lmsg);
+}
+
 static void do_replace(int argc, char **argv, int drop)
 {
 	struct lananlmsg lmsg;
@@ -388,6 +471,260 @@ static void do_unsubscribe(int argc, char **argv)
 	send_netlink(&lmsg);
 }
 
+static void do_stats(int argc, char **argv)
+{
+	struct lananlmsg lmsg;
+	struct lananlmsg_stats *msg;
+
+	if (argc != 1)
+		usage();
+
+	memset(&lmsg, 0, sizeof(lmsg));
+	lmsg.cmd = NETLINK_USERCTL_CMD_STATS;
+	msg = (struct lananlmsg_stats *) lmsg.buff;
+	strlcpy(msg->name, argv[0], sizeof(msg->name));
+	send_netlink_reply(&lmsg);
+
+	printf("name idp pkts bytes drops cycles cycles/pkt\n");
+	printf("%s %u %llu %llu %llu %llu %llu\n", msg->name, msg->idp,
+	       (unsigned long long) msg->pkts,
+	       (unsigned long long) msg->bytes,
+	       (unsigned long long) msg->drops,
+	       (unsigned long long) msg->cycles,
+	       (unsigned long long) (msg->pkts ? msg->cycles / msg->pkts : 0));
+}
+
+static const struct {
+	const char *name;
+	uint32_t cmd;
+	int args;
+} commit_cmds[] = {
+	{ "add",	NETLINK_USERCTL_CMD_ADD,	 2 },
+	{ "set",	NETLINK_USERCTL_CMD_SET,	 2 },
+	{ "rm",		NETLINK_USERCTL_CMD_RM,		 1 },
+	{ "bind",	NETLINK_USERCTL_CMD_BIND,	 2 },
+	{ "unbind",	NETLINK_USERCTL_CMD_UNBIND,	 2 },
+	{ "bindport",	NETLINK_USERCTL_CMD_BIND_PORT,	 3 },
+	{ "unbindport",	NETLINK_USERCTL_CMD_UNBIND_PORT, 3 },
+};
+
+static const char *commit_cmd_name(uint32_t cmd)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(commit_cmds) / sizeof(commit_cmds[0]); ++i)
+		if (commit_cmds[i].cmd == cmd)
+			return commit_cmds[i].name;
+	return "?";
+}
+
+/* Parses one "<cmd> <args> ..." line of a commit file into op. */
+static void commit_parse_line(char *line, int lineno,
+			      struct lananlmsg_op *op)
+{
+	size_t i;
+	int argc = 0;
+	char *argv[4], *tok;
+
+	for (tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+		if (argc == 4)
+			panic("Line %d: too many arguments!\n", lineno);
+		argv[argc++] = tok;
+	}
+
+	for (i = 0; i < sizeof(commit_cmds) / sizeof(commit_cmds[0]); ++i)
+		if (!strcmp(commit_cmds[i].name, argv[0]))
+			break;
+	if (i == sizeof(commit_cmds) / sizeof(commit_cmds[0]))
+		panic("Line %d: unknown command %s!\n", lineno, argv[0]);
+	if (argc - 1 != commit_cmds[i].args)
+		panic("Line %d: %s takes %d arguments!\n", lineno, argv[0],
+		      commit_cmds[i].args);
+
+	op->cmd = commit_cmds[i].cmd;
+	strlcpy(op->name1, argv[1], sizeof(op->name1));
+	switch (op->cmd) {
+	case NETLINK_USERCTL_CMD_ADD:
+	case NETLINK_USERCTL_CMD_SET:
+		strlcpy(op->arg, argv[2], sizeof(op->arg));
+		break;
+	case NETLINK_USERCTL_CMD_BIND_PORT:
+	case NETLINK_USERCTL_CMD_UNBIND_PORT:
+		op->port = (uint32_t) strtoul(argv[3], NULL, 10);
+		/* fall through */
+	case NETLINK_USERCTL_CMD_BIND:
+	case NETLINK_USERCTL_CMD_UNBIND:
+		strlcpy(op->name2, argv[2], sizeof(op->name2));
+		break;
+	}
+}
+
+static void do_commit(int argc, char **argv)
+{
+	FILE *fp;
+	int lineno = 0;
+	size_t len;
+	uint32_t i, max = 64;
+	char line[512], *p;
+	struct lananlmsg *lmsg;
+	struct lananlmsg_trans *trans;
+	struct lananlmsg_op *ops;
+
+	if (argc != 1)
+		usage();
+
+	fp = fopen(argv[0], "r");
+	if (!fp)
+		panic("Cannot open %s!\n", argv[0]);
+
+	ops = xzmalloc(max * sizeof(*ops));
+	i = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		for (p = line; *p == ' ' || *p == '\t'; ++p)
+			;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+			continue;
+		if (i == USERCTL_TRANS_MAX)
+			panic("More than %u operations!\n", USERCTL_TRANS_MAX);
+		if (i == max) {
+			ops = realloc(ops, 2 * max * sizeof(*ops));
+			if (!ops)
+				panic("No mem left!\n");
+			memset(ops + max, 0, max * sizeof(*ops));
+			max *= 2;
+		}
+		commit_parse_line(p, lineno, &ops[i++]);
+	}
+	fclose(fp);
+
+	len = offsetof(struct lananlmsg, buff) + sizeof(*trans) +
+	      i * sizeof(*ops);
+	if (len < sizeof(*lmsg))
+		len = sizeof(*lmsg);
+
+	lmsg = xzmalloc(len);
+	lmsg->cmd = NETLINK_USERCTL_CMD_COMMIT;
+	trans = (struct lananlmsg_trans *) lmsg->buff;
+	trans->num = i;
+	memcpy(trans->op, ops, i * sizeof(*ops));
+	xfree(ops);
+
+	__send_netlink(lmsg, len, 1);
+
+	for (i = 0; i < trans->num; ++i) {
+		if (trans->op[i].status && trans->op[i].status != -ECANCELED)
+			printf("op %u (%s %s): %s\n", i,
+			       commit_cmd_name(trans->op[i].cmd),
+			       trans->op[i].name1,
+			       strerror(-trans->op[i].status));
+	}
+	if (trans->failed < 0)
+		printf("committed %u operations\n", trans->num);
+	else
+		printf("aborted at op %d\n", trans->failed);
+
+	xfree(lmsg);
+}
+
+static void dump_fblock(struct lananlmsg_dump_fblock *rec)
+{
+	uint32_t i;
+
+	printf("%s %s %u %d %llu %llu %llu %llu ", rec->name, rec->type,
+	       rec->idp, rec->refcnt, (unsigned long long) rec->pkts,
+	       (unsigned long long) rec->bytes,
+	       (unsigned long long) rec->drops,
+	       (unsigned long long) rec->cycles);
+	for (i = 0; i < rec->num_ports; ++i)
+		printf(i ? ",%u" : "%u", rec->idps[i]);
+	printf(" [");
+	for (i = 0; i < rec->num_subs; ++i)
+		printf(i ? " %u" : "%u", rec->idps[rec->num_ports + i]);
+	if (rec->subs > rec->num_subs)
+		printf(" +%u", rec->subs - rec->num_subs);
+	printf("]\n");
+}
+
+static void dump_engine(struct lananlmsg_dump_engine *rec)
+{
+	printf("CPU%u %llu %llu %llu %llu %llu %llu %llu %llu %u %u %llu\n",
+	       rec->cpu, (unsigned long long) rec->pkts,
+	       (unsigned long long) rec->bytes,
+	       (unsigned long long) rec->fblocks,
+	       (unsigned long long) rec->sched,
+	       (unsigned long long) rec->resched,
+	       (unsigned long long) rec->drops,
+	       (unsigned long long) rec->steals,
+	       (unsigned long long) rec->hits, rec->backlog, rec->hiwat,
+	       (unsigned long long) rec->lost);
+}
+
+static void do_dump(int argc, char **argv)
+{
+	int sock, ret, engine = 0, done = 0;
+	size_t bufsiz = 1 << 16;
+	struct sockaddr_nl dest_addr;
+	struct nlmsghdr *nlh;
+	struct lananlmsg *lmsg;
+	char *buff;
+
+	if (argc != 0)
+		usage();
+
+	sock = open_netlink(1 << 20);
+
+	memset(&dest_addr, 0, sizeof(dest_addr));
+	dest_addr.nl_family = AF_NETLINK;
+
+	nlh = xzmalloc(NLMSG_SPACE(sizeof(*lmsg)));
+	nlh->nlmsg_len = NLMSG_SPACE(sizeof(*lmsg));
+	nlh->nlmsg_pid = getpid();
+	nlh->nlmsg_type = USERCTLGRP_CONF;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	lmsg = NLMSG_DATA(nlh);
+	lmsg->cmd = NETLINK_USERCTL_CMD_DUMP;
+
+	ret = sendto(sock, nlh, nlh->nlmsg_len, 0,
+		     (struct sockaddr *) &dest_addr, sizeof(dest_addr));
+	if (unlikely(ret < 0))
+		panic("Cannot send NETLINK message to the kernel!\n");
+	xfree(nlh);
+
+	buff = xzmalloc(bufsiz);
+	printf("name type idp refcnt pkts bytes drops cycles ports [subs]\n");
+	while (!done) {
+		ret = recv(sock, buff, bufsiz, 0);
+		if (unlikely(ret < 0))
+			panic("Cannot receive NETLINK message from the "
+			      "kernel!\n");
+
+		nlh = (struct nlmsghdr *) buff;
+		for (; NLMSG_OK(nlh, (unsigned int) ret);
+		     nlh = NLMSG_NEXT(nlh, ret)) {
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+			if (nlh->nlmsg_type == NLMSG_ERROR)
+				panic("Kernel refused request!\n");
+			if (nlh->nlmsg_type == USERCTL_DUMP_FBLOCK &&
+			    nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct lananlmsg_dump_fblock)))
+				dump_fblock(NLMSG_DATA(nlh));
+			else if (nlh->nlmsg_type == USERCTL_DUMP_ENGINE &&
+				 nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct lananlmsg_dump_engine))) {
+				if (!engine++)
+					printf("cpu pkts bytes fblocks sched resched "
+					       "drops steals hits backlog hiwat lost\n");
+				dump_engine(NLMSG_DATA(nlh));
+			}
+		}
+	}
+
+	close(sock);
+	xfree(buff);
+}
+
 int main(int argc, char **argv)
 {
 	check_for_root_maybe_die();
@@ -407,6 +744,10 @@ int main(int argc, char **argv)
 		do_set(--argc, ++argv);
 	else if (!strncmp("rm", argv[0], strlen("rm")))
 		do_rm(--argc, ++argv);
+	else if (!strncmp("bindport", argv[0], strlen("bindport")))
+		do_bind_port(--argc, ++argv, 1);
+	else if (!strncmp("unbindport", argv[0], strlen("unbindport")))
+		do_bind_port(--argc, ++argv, 0);
 	else if (!strncmp("bind", argv[0], strlen("bind")))
 		do_bind(--argc, ++argv);
 	else if (!strncmp("unbind", argv[0], strlen("unbind")))
@@ -419,6 +760,12 @@ int main(int argc, char **argv)
 		do_subscribe(--argc, ++argv);
 	else if (!strncmp("unsubscribe", argv[0], strlen("unsubscribe")))
 		do_unsubscribe(--argc, ++argv);
+	else if (!strncmp("stats", argv[0], strlen("stats")))
+		do_stats(--argc, ++argv);
+	else if (!strncmp("commit", argv[0], strlen("commit")))
+		do_commit(--argc, ++argv);
+	else if (!strncmp("dump", argv[0], strlen("dump")))
+		do_dump(--argc, ++argv);
 	else
 		usage();
 